@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+#
+# Connection-to-first-result latency, with pgbench opening a new connection
+# for every transaction.  Each backend makes a single call, so the plv8 cost
+# is the difference between the pg_add and js_add runs.
+#
+# Requires bench/definitions.sql loaded.  Compare a server with and without
+# plv8 in shared_preload_libraries and with plv8.use_snapshot on and off.
+#
+# usage: bench/connect.sh [dbname] [transactions]
+
+DB=${1:-postgres}
+N=${2:-1000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+	echo "$1" > "$SCRIPT"
+	echo "== $1"
+	pgbench -n -C -t "$N" -f "$SCRIPT" "$DB" | grep -E '^(latency|tps)'
+}
+
+run 'select 1;'
+run 'select pg_add(1, 1);'
+run 'select js_add(1, 1);'
@@ -0,0 +1,26 @@
+-- Running one INSERT for many rows of parameters.
+--
+-- Requires bench/definitions.sql loaded.  Each call inserts 100k rows, once
+-- through plv8.execute() per row and once through plv8.execute_many(), which
+-- runs all of the rows in one subtransaction and makes no result per row.
+
+create table if not exists bench_many (i int, t text);
+
+create or replace function execute_loop(n int) returns void as $$
+	for (var i = 0; i < n; i++)
+		plv8.execute('insert into bench_many values ($1, $2)', [i, 'row ' + i]);
+$$ language plv8;
+
+create or replace function execute_many(n int) returns void as $$
+	var rows = new Array(n);
+	for (var i = 0; i < n; i++)
+		rows[i] = [i, 'row ' + i];
+	plv8.execute_many('insert into bench_many values ($1, $2)', rows);
+$$ language plv8;
+
+select plbench('select execute_loop(100000)', 1);  -- warm up
+truncate bench_many;
+select 'loop' as mode, plbench('select execute_loop(100000)', 5) as ms;
+truncate bench_many;
+select 'execute_many' as mode, plbench('select execute_many(100000)', 5) as ms;
+drop table bench_many;
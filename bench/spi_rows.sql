@@ -0,0 +1,45 @@
+-- Conversion of SPI results into JavaScript row objects.
+--
+-- Requires bench/definitions.sql loaded.  The rows run fetches 1M rows
+-- through plv8.execute(), so the timing is dominated by Converter::ToValue;
+-- the columnar run shows the cost of the same rows without per-row objects.
+-- The small queries run fetches one row per query 100k times, which shows
+-- the cost of setting up the conversion of each result set.
+
+create or replace function spi_rows(n int) returns float8 as $$
+	var rows = plv8.execute('select i, i * 2 as j, i::float8 / 3 as f, ' +
+		'(i % 100)::text as t from generate_series(1, $1) i', [n]);
+	var sum = 0;
+	for (var i = 0; i < rows.length; i++)
+		sum += rows[i].j;
+	return sum;
+$$ language plv8;
+
+create or replace function spi_columns(n int) returns float8 as $$
+	var cols = plv8.execute('select i, i * 2 as j, i::float8 / 3 as f, ' +
+		'(i % 100)::text as t from generate_series(1, $1) i', [n],
+		{ columnar: true });
+	var sum = 0;
+	for (var i = 0; i < cols.j.length; i++)
+		sum += cols.j[i];
+	return sum;
+$$ language plv8;
+
+select plbench('select spi_rows(1000000)', 1);  -- warm up
+select 'rows' as mode, plbench('select spi_rows(1000000)', 5) as ms;
+select 'columnar' as mode, plbench('select spi_columns(1000000)', 5) as ms;
+
+-- Many small result sets, where the row constructor of the columns is
+-- looked up once per query rather than built.
+create or replace function spi_small_queries(n int) returns float8 as $$
+	var plan = plv8.prepare('select $1::int as i, $1::int * 2 as j, ' +
+		'$1::float8 / 3 as f, ($1::int % 100)::text as t', ['int']);
+	var sum = 0;
+	for (var q = 0; q < n; q++)
+		sum += plan.execute([q])[0].j;
+	plan.free();
+	return sum;
+$$ language plv8;
+
+select plbench('select spi_small_queries(100000)', 1);  -- warm up
+select 'small queries' as mode, plbench('select spi_small_queries(100000)', 5) as ms;
@@ -0,0 +1,23 @@
+-- Per-call overhead of plv8 calls, which arm the watchdog.
+--
+-- Requires bench/definitions.sql loaded.  The watchdog is armed on every
+-- call so that query cancel reaches running JS, and cannot be turned off;
+-- the baseline is pg_add, a SQL function doing the same work.  Run it on
+-- the commit before the watchdog as well to see the watchdog's share of
+-- the js_add timing.  With EXECUTION_TIMEOUT, each call sets a deadline
+-- too, which the last query shows.
+
+create table if not exists bench_rows as
+	select i from generate_series(1, 1000000) i;
+
+select plbench('select sum(js_add(i, 1)) from bench_rows', 1);  -- warm up
+select 'pg_add' as function,
+	plbench('select sum(pg_add(i, 1)) from bench_rows', 5) as ms;
+select 'js_add' as function,
+	plbench('select sum(js_add(i, 1)) from bench_rows', 5) as ms;
+
+set plv8.execution_timeout = 300;
+select 'js_add, deadline' as function,
+	plbench('select sum(js_add(i, 1)) from bench_rows', 5) as ms;
+
+reset plv8.execution_timeout;
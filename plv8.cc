@@ -14,7 +14,12 @@
 #include "libplatform/libplatform.h"
 #include "plv8_allocator.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <new>
+#include <thread>
 
 extern "C" {
 #if PG_VERSION_NUM >= 90300
@@ -29,6 +34,7 @@ extern "C" {
 #include "miscadmin.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
@@ -40,18 +46,12 @@ extern "C" {
 
 #if PG_VERSION_NUM >= 130000
 #include "common/hashfn.h"
+#else
+#include "access/hash.h"
 #endif
 
 #include <signal.h>
 
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-#include <windows.h>
-#else
-#include <unistd.h>
-#endif
-#endif
-
 PG_MODULE_MAGIC;
 
 PGDLLEXPORT Datum	plv8_call_handler(PG_FUNCTION_ARGS);
@@ -62,6 +62,7 @@ PGDLLEXPORT Datum	plls_call_handler(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plls_call_validator(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plv8_reset(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum	plv8_info(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum	plv8_create_snapshot(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(plv8_call_handler);
 PG_FUNCTION_INFO_V1(plv8_call_validator);
@@ -71,6 +72,7 @@ PG_FUNCTION_INFO_V1(plls_call_handler);
 PG_FUNCTION_INFO_V1(plls_call_validator);
 PG_FUNCTION_INFO_V1(plv8_reset);
 PG_FUNCTION_INFO_V1(plv8_info);
+PG_FUNCTION_INFO_V1(plv8_create_snapshot);
 
 
 PGDLLEXPORT void _PG_init(void);
@@ -98,6 +100,8 @@ typedef struct plv8_proc_cache
 
 	TransactionId			fn_xmin;
 	ItemPointerData			fn_tid;
+	uint32					hashvalue;	/* of the pg_proc syscache entry */
+	bool					valid;		/* cleared by invalidations */
 	Oid						user_id;
 
 	int						nargs;
@@ -106,7 +110,63 @@ typedef struct plv8_proc_cache
 	Oid						argtypes[FUNC_MAX_ARGS];
 } plv8_proc_cache;
 
+/*
+ * Compiled DO blocks of a context, by a hash of their source and dialect.
+ * The source is kept to tell apart blocks whose hashes collide.
+ */
+typedef struct plv8_inline_key
+{
+	uint32					hash;
+	Dialect					dialect;
+} plv8_inline_key;
+
+typedef struct plv8_inline_cache
+{
+	plv8_inline_key			key;
+
+	Persistent<Function>	function;
+	char				   *source;
+	uint64					last_used;
+} plv8_inline_cache;
+
+/*
+ * Converters of a context, kept by row type.  A Converter replaced after
+ * its type has been altered may still be in use by a caller further up
+ * the stack, so it is only retired, and deleted at the end of transaction.
+ */
+typedef struct plv8_converter_key
+{
+	Oid						typid;
+	int32					typmod;
+} plv8_converter_key;
+
+typedef struct plv8_converter_cache
+{
+	plv8_converter_key		key;
+
+	Converter			   *converter;
+} plv8_converter_cache;
+
+/*
+ * Row constructors of a context, by a hash of their column names, so that
+ * the rows of every query with the same columns share a hidden class.  The
+ * names are kept, separated by '\0', to tell apart lists whose hashes
+ * collide.
+ */
+#define PLV8_ROW_FUNCTIONS	256
+
+typedef struct plv8_row_function
+{
+	uint32					hash;
+
+	Persistent<Function>	function;
+	char				   *names;
+	int						length;
+	uint64					last_used;
+} plv8_row_function;
+
 plv8_context *current_context = nullptr;
+uint64 plv8_xact_count = 0;		/* transactions ended, to tell them apart */
 size_t plv8_memory_limit = 0;
 size_t plv8_last_heap_size = 0;
 
@@ -121,6 +181,8 @@ typedef struct plv8_exec_env
 	Persistent<Object>		recv;
 	Persistent<Context>		context;
 	Local<Context> localContext() { return Local<Context>::New(isolate, context) ; }
+	Persistent<Object>		generator;	/* set being returned value per call */
+	Converter			   *generator_conv;
 	struct plv8_exec_env   *next;
 } plv8_exec_env;
 
@@ -141,6 +203,27 @@ static HTAB *plv8_proc_cache_hash = NULL;
 
 static plv8_exec_env		   *exec_env_head = NULL;
 
+/*
+ * Whether the innermost DoCall has connected to SPI.  Most functions never
+ * run a query, so the connection is made on first use by the built-ins that
+ * need it, and DoCall only disconnects if that happened.
+ */
+static bool spi_connected = false;
+
+/*
+ * The trigger data of the innermost DoCall if it runs a trigger, whose
+ * transition tables are registered with SPI on connection.
+ */
+static TriggerData *spi_trigdata = NULL;
+
+/*
+ * The error of a statement run without a subtransaction.  Nothing has been
+ * rolled back, so JS must not go on: the call is terminated, and the error
+ * is raised again by the innermost DoCall or plv8.subtransaction() when the
+ * JS frames are gone.  Allocated in TopTransactionContext.
+ */
+ErrorData *spi_pending_error = NULL;
+
 extern const unsigned char coffee_script_binary_data[];
 extern const unsigned char livescript_binary_data[];
 
@@ -150,7 +233,20 @@ extern const unsigned char livescript_binary_data[];
  */
 static plv8_proc *plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo,
 		bool validate, char ***argnames) throw();
+static HTAB *plv8_create_proc_cache_hash(const char *name);
+#if PG_VERSION_NUM >= 90200
+static void plv8_proc_cache_inval(Datum arg, int cacheid, uint32 hashvalue);
+#else
+static void plv8_proc_cache_inval(Datum arg, int cacheid, ItemPointer tuplePtr);
+#endif
+static StartupData *plv8_load_snapshot();
 static void plv8_xact_cb(XactEvent event, void *arg);
+static void plv8_dispose_context(plv8_context *context);
+static void plv8_release_inline_cache(plv8_context *context);
+static void plv8_release_converters(plv8_context *context, bool retired_only);
+static void plv8_release_row_functions(plv8_context *context);
+static void plv8_trim_contexts(void);
+static void plv8_release_generator(Datum arg);
 
 /*
  * CamelCaseFunctions are C++ functions.
@@ -161,7 +257,7 @@ static plv8_exec_env *CreateExecEnv(Persistent<Function>& function, plv8_context
 static plv8_proc *Compile(Oid fn_oid, FunctionCallInfo fcinfo,
 					bool validate, bool is_trigger, Dialect dialect);
 static Local<Function> CompileFunction(plv8_context *global_context,
-					const char *proname, int proarglen,
+					Oid fn_oid, const char *proname, int proarglen,
 					const char *proargs[], const char *prosrc,
 					bool is_trigger, bool retset, Dialect dialect);
 static Datum CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
@@ -169,9 +265,19 @@ static Datum CallFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 static Datum CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 		int nargs, plv8_type argtypes[], plv8_type *rettype);
 static Datum CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv);
+static bool GeneratorNext(Handle<Context> context, Handle<Object> generator,
+		Local<v8::Value> *value);
+static Datum StartGenerator(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
+		Handle<Object> generator, Tuplestorestate *tupstore, TupleDesc tupdesc);
+static Datum ResumeGenerator(PG_FUNCTION_ARGS, plv8_exec_env *xenv);
 static plv8_context *GetPlv8Context();
 static Local<ObjectTemplate> GetGlobalObjectTemplate(Isolate *isolate);
-static void CreateIsolate(plv8_context *context);
+static void InitializeV8();
+static void CreateIsolate(plv8_context *context, StartupData *snapshot);
+static int CreateSnapshot();
+static Local<Function> GetInlineFunction(plv8_context *context,
+		const char *source, Dialect dialect);
+static void WatchdogReset();
 
 /* A GUC to specify a custom start up function to call */
 static char *plv8_start_proc = NULL;
@@ -189,13 +295,51 @@ static int plv8_debugger_port;
 static int plv8_execution_timeout = 300;
 #endif
 
+/* A GUC to keep V8 code cache of compiled functions in the data directory */
+static bool plv8_code_cache = false;
+
+/* A GUC to create new contexts from the startup snapshot */
+static bool plv8_use_snapshot = false;
+
+/* A GUC to limit the number of isolates kept by a backend */
+static int plv8_max_isolates = 0;
+
+/* A GUC to limit the number of compiled DO blocks kept by a context */
+static int plv8_inline_cache_size = 64;
+
+/* A GUC to limit the number of statement plans kept by a context */
+int plv8_statement_cache_size = 64;
+
+/* A GUC to run each statement of plv8.execute() in a subtransaction */
+bool plv8_execute_subtransaction = true;
+
+/* Name of the startup snapshot in the persistent cache */
+#define PLV8_SNAPSHOT_NAME	"snapshot"
+
+/*
+ * The startup snapshot, read once per backend and kept for the lifetime of
+ * the isolates created from it.
+ */
+static StartupData *snapshot_blob = NULL;
+
+/* The context being saved by plv8_create_snapshot(), if any */
+static plv8_context *snapshot_context = NULL;
+
 static std::unique_ptr<v8::Platform> v8_platform = NULL;
 
 /*
- * We use vector instead of hash since the size of this array
- * is expected to be short in most cases.
+ * Contexts of this backend, one per user.  last_used of each context is set
+ * from context_clock whenever it is looked up, and the least recently used
+ * ones are disposed at the end of the transaction beyond plv8.max_isolates.
  */
-static std::vector<plv8_context *> ContextVector;
+typedef struct plv8_context_entry
+{
+	Oid				user_id;
+	plv8_context   *context;
+} plv8_context_entry;
+
+static HTAB *plv8_context_hash = NULL;
+static uint64 context_clock = 0;
 
 #ifdef ENABLE_DEBUGGER_SUPPORT
 v8::Persistent<v8::Context> debug_message_context;
@@ -248,32 +392,99 @@ size_t NearHeapLimitHandler(void* data, size_t current_heap_limit,
 	return current_heap_limit + 1_MB;
 }
 
+/*
+ * Stop JS that goes beyond plv8.memory_limit.
+ */
+static void
+SetIsolateLimits(Isolate *isolate)
+{
+	isolate->SetOOMErrorHandler(OOMErrorHandler);
+	isolate->AddGCEpilogueCallback(GCEpilogueCallback);
+	isolate->AddNearHeapLimitCallback(NearHeapLimitHandler, NULL);
+}
+
 static void
-CreateIsolate(plv8_context *context) {
+CreateIsolate(plv8_context *context, StartupData *snapshot) {
 	Isolate *isolate;
 	Isolate::CreateParams params;
 	params.array_buffer_allocator = new ArrayAllocator(plv8_memory_limit * 1_MB);
+	if (snapshot != NULL)
+	{
+		params.snapshot_blob = snapshot;
+		params.external_references = GetExternalReferences();
+	}
 	ResourceConstraints rc;
 	rc.ConfigureDefaults(plv8_memory_limit * 1_MB * 2, plv8_memory_limit * 1_MB * 2);
 	params.constraints = rc;
 	isolate = Isolate::New(params);
-	isolate->SetOOMErrorHandler(OOMErrorHandler);
-	isolate->AddGCEpilogueCallback(GCEpilogueCallback);
-	isolate->AddNearHeapLimitCallback(NearHeapLimitHandler, NULL);
+	SetIsolateLimits(isolate);
 	context->isolate = isolate;
 	context->array_buffer_allocator = params.array_buffer_allocator;
 }
 
+static HTAB *
+plv8_create_proc_cache_hash(const char *name)
+{
+	HASHCTL    hash_ctl = { 0 };
+
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(plv8_proc_cache);
+	hash_ctl.hash = oid_hash;
+	return hash_create(name, 32, &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+}
+
+/*
+ * Invalidate the entries of changed functions, and drop their compiled code
+ * right away so that it does not linger in the isolates.  An entry without
+ * a function may be in the middle of being compiled, so its source is left
+ * for plv8_get_proc to replace.
+ */
+#if PG_VERSION_NUM >= 90200
+static void
+plv8_proc_cache_inval(Datum arg, int cacheid, uint32 hashvalue)
+#else
+static void
+plv8_proc_cache_inval(Datum arg, int cacheid, ItemPointer tuplePtr)
+#endif
+{
+	HASH_SEQ_STATUS		status;
+	plv8_proc_cache	   *cache;
+
+	hash_seq_init(&status, plv8_proc_cache_hash);
+	while ((cache = (plv8_proc_cache *) hash_seq_search(&status)) != NULL)
+	{
+#if PG_VERSION_NUM >= 90200
+		if (hashvalue != 0 && cache->hashvalue != hashvalue)
+			continue;
+#else
+		if (tuplePtr != NULL && !ItemPointerEquals(&cache->fn_tid, tuplePtr))
+			continue;
+#endif
+		cache->valid = false;
+		if (!cache->function.IsEmpty())
+		{
+			cache->function.Reset();
+			if (cache->prosrc)
+			{
+				pfree(cache->prosrc);
+				cache->prosrc = NULL;
+			}
+		}
+	}
+}
+
 void
 _PG_init(void)
 {
 	HASHCTL    hash_ctl = { 0 };
 
+	plv8_proc_cache_hash = plv8_create_proc_cache_hash("PLv8 Procedures");
+
 	hash_ctl.keysize = sizeof(Oid);
-	hash_ctl.entrysize = sizeof(plv8_proc_cache);
+	hash_ctl.entrysize = sizeof(plv8_context_entry);
 	hash_ctl.hash = oid_hash;
-	plv8_proc_cache_hash = hash_create("PLv8 Procedures", 32,
-									   &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+	plv8_context_hash = hash_create("PLv8 Contexts", 8,
+									&hash_ctl, HASH_ELEM | HASH_FUNCTION);
 
 	DefineCustomStringVariable("plv8.start_proc",
 							   gettext_noop("PLV8 function to run once when PLV8 is first used."),
@@ -327,10 +538,10 @@ _PG_init(void)
 #ifdef EXECUTION_TIMEOUT
 	DefineCustomIntVariable("plv8.execution_timeout",
 							gettext_noop("V8 execution timeout."),
-							gettext_noop("The default value is 300 seconds.  "
+							gettext_noop("The default value is 300 seconds, 0 disables the timeout.  "
 										 "This allows you to override the default execution timeout."),
 							&plv8_execution_timeout,
-							300, 1, 65536,
+							300, 0, 65536,
 							PGC_USERSET, 0,
 #if PG_VERSION_NUM >= 90100
 							NULL,
@@ -351,7 +562,88 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("plv8.code_cache",
+							 gettext_noop("Keep V8 code cache of compiled functions in the data directory."),
+							 gettext_noop("Backends then skip most of the compilation on the first call of "
+										  "a function, and the translation of CoffeeScript and LiveScript."),
+							 &plv8_code_cache,
+							 false,
+							 PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("plv8.max_isolates",
+							gettext_noop("Maximum number of isolates kept by a backend, 0 for no limit."),
+							gettext_noop("Each user gets its own isolate.  Beyond this limit, the least "
+										 "recently used ones are disposed at the end of the transaction."),
+							&plv8_max_isolates,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("plv8.inline_cache_size",
+							gettext_noop("Number of compiled DO blocks kept by each context, 0 to disable."),
+							NULL,
+							&plv8_inline_cache_size,
+							64,
+							0,
+							INT_MAX,
+							PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("plv8.execute_subtransaction",
+							 gettext_noop("Run each statement of plv8.execute() in its own subtransaction."),
+							 gettext_noop("When off, an error in a statement aborts the transaction, unless it is run in plv8.subtransaction()."),
+							 &plv8_execute_subtransaction,
+							 true,
+							 PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("plv8.statement_cache_size",
+							gettext_noop("Number of plv8.execute() statements kept prepared by each context, 0 to disable."),
+							NULL,
+							&plv8_statement_cache_size,
+							64,
+							0,
+							INT_MAX,
+							PGC_USERSET, 0,
+#if PG_VERSION_NUM >= 90100
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("plv8.use_snapshot",
+							 gettext_noop("Create new contexts from the snapshot made by plv8_create_snapshot()."),
+							 gettext_noop("plv8.start_proc is not run for contexts created from the snapshot."),
+							 &plv8_use_snapshot,
+							 false,
+							 PGC_SUSET, 0,
+#if PG_VERSION_NUM >= 90100
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
 	RegisterXactCallback(plv8_xact_cb, NULL);
+	CacheRegisterSyscacheCallback(PROCOID, plv8_proc_cache_inval, (Datum) 0);
 
 	EmitWarningsOnPlaceholders("plv8");
 
@@ -366,14 +658,33 @@ _PG_init(void)
 #if (V8_MAJOR_VERSION == 4 && V8_MINOR_VERSION >= 6) || V8_MAJOR_VERSION >= 5
 	V8::InitializeExternalStartupData("plv8");
 #endif
-	if (!v8_platform) {
-		v8_platform = platform::NewDefaultPlatform();
-	}
-	V8::InitializePlatform(v8_platform.get());
-	V8::Initialize();
 	if (plv8_v8_flags != NULL) {
 		V8::SetFlagsFromString(plv8_v8_flags, strlen(plv8_v8_flags));
 	}
+
+	/*
+	 * When loaded by shared_preload_libraries, read the startup snapshot in
+	 * the postmaster, so that every backend inherits it.  V8 itself is only
+	 * initialized by each backend, see InitializeV8().
+	 */
+	if (process_shared_preload_libraries_in_progress && plv8_use_snapshot)
+		plv8_load_snapshot();
+}
+
+/*
+ * Set up the platform and V8 on first use.  The default platform starts
+ * worker threads, which do not survive fork(), so this must not run in the
+ * postmaster when preloaded.
+ */
+static void
+InitializeV8()
+{
+	if (v8_platform)
+		return;
+
+	v8_platform = platform::NewDefaultPlatform();
+	V8::InitializePlatform(v8_platform.get());
+	V8::Initialize();
 }
 
 static void
@@ -387,6 +698,7 @@ plv8_xact_cb(XactEvent event, void *arg)
 		{
 			env->recv.Reset();
 		}
+		plv8_release_generator(PointerGetDatum(env));
 		env = env->next;
 		/*
 		 * Each item was allocated in TopTransactionContext, so
@@ -394,6 +706,183 @@ plv8_xact_cb(XactEvent event, void *arg)
 		 */
 	}
 	exec_env_head = NULL;
+
+	if (plv8_context_hash != NULL)
+	{
+		HASH_SEQ_STATUS		status;
+		plv8_context_entry *entry;
+
+		hash_seq_init(&status, plv8_context_hash);
+		while ((entry = (plv8_context_entry *) hash_seq_search(&status)) != NULL)
+			plv8_release_converters(entry->context, true);
+	}
+
+	plv8_xact_count++;
+	WatchdogReset();
+	spi_connected = false;
+	spi_pending_error = NULL;
+
+	if (plv8_max_isolates > 0)
+		plv8_trim_contexts();
+}
+
+/*
+ * Dispose the isolate of context, and everything compiled in it.
+ */
+static void
+plv8_dispose_context(plv8_context *context)
+{
+	HASH_SEQ_STATUS		status;
+	plv8_proc_cache	   *cache;
+
+	hash_search(plv8_context_hash, &context->user_id, HASH_REMOVE, NULL);
+
+	/* functions compiled for the user belong to the isolate */
+	hash_seq_init(&status, plv8_proc_cache_hash);
+	while ((cache = (plv8_proc_cache *) hash_seq_search(&status)) != NULL)
+	{
+		if (cache->user_id == context->user_id)
+		{
+			if (cache->prosrc)
+			{
+				pfree(cache->prosrc);
+				cache->prosrc = NULL;
+			}
+			cache->function.Reset();
+		}
+	}
+
+	context->context.Reset();
+	context->recv_templ.Reset();
+	context->compile_context.Reset();
+	context->plan_template.Reset();
+	context->cursor_template.Reset();
+	context->window_template.Reset();
+	context->iterator_template.Reset();
+	plv8_release_inline_cache(context);
+	plv8_release_converters(context, false);
+	plv8_release_row_functions(context);
+	plv8_release_statements(context);
+	plv8_release_plans(context);
+	delete context->array_buffer_allocator;
+	context->isolate->Dispose();
+
+	if (current_context == context)
+		current_context = nullptr;
+	pfree(context);
+}
+
+/*
+ * Drop the generator of a set being returned value per call.  This is also
+ * the shutdown callback of the expression context, for when the executor
+ * stops before the set is exhausted.
+ */
+static void
+plv8_release_generator(Datum arg)
+{
+	plv8_exec_env	   *xenv = (plv8_exec_env *) DatumGetPointer(arg);
+
+	xenv->generator.Reset();
+	if (xenv->generator_conv != NULL)
+	{
+		delete xenv->generator_conv;
+		xenv->generator_conv = NULL;
+	}
+}
+
+/*
+ * Drop the compiled DO blocks of context.
+ */
+static void
+plv8_release_inline_cache(plv8_context *context)
+{
+	HASH_SEQ_STATUS		status;
+	plv8_inline_cache  *entry;
+
+	if (context->inline_functions == NULL)
+		return;
+
+	hash_seq_init(&status, context->inline_functions);
+	while ((entry = (plv8_inline_cache *) hash_seq_search(&status)) != NULL)
+	{
+		entry->function.Reset();
+		if (entry->source)
+			pfree(entry->source);
+	}
+	hash_destroy(context->inline_functions);
+	context->inline_functions = NULL;
+}
+
+/*
+ * Delete the retired Converters of context, or all of them.
+ */
+static void
+plv8_release_converters(plv8_context *context, bool retired_only)
+{
+	ListCell	   *lc;
+
+	foreach(lc, context->retired_converters)
+		delete (Converter *) lfirst(lc);
+	list_free(context->retired_converters);
+	context->retired_converters = NIL;
+
+	if (retired_only || context->converters == NULL)
+		return;
+
+	HASH_SEQ_STATUS			status;
+	plv8_converter_cache   *entry;
+
+	hash_seq_init(&status, context->converters);
+	while ((entry = (plv8_converter_cache *) hash_seq_search(&status)) != NULL)
+		delete entry->converter;
+	hash_destroy(context->converters);
+	context->converters = NULL;
+}
+
+/*
+ * Drop the row constructors of context.
+ */
+static void
+plv8_release_row_functions(plv8_context *context)
+{
+	HASH_SEQ_STATUS		status;
+	plv8_row_function  *entry;
+
+	if (context->row_functions == NULL)
+		return;
+
+	hash_seq_init(&status, context->row_functions);
+	while ((entry = (plv8_row_function *) hash_seq_search(&status)) != NULL)
+	{
+		entry->function.Reset();
+		if (entry->names)
+			pfree(entry->names);
+	}
+	hash_destroy(context->row_functions);
+	context->row_functions = NULL;
+}
+
+/*
+ * Dispose the least recently used contexts beyond plv8.max_isolates.  This
+ * only runs at the end of a transaction, when no JavaScript is running.
+ */
+static void
+plv8_trim_contexts(void)
+{
+	while (hash_get_num_entries(plv8_context_hash) > plv8_max_isolates)
+	{
+		HASH_SEQ_STATUS		status;
+		plv8_context_entry *entry;
+		plv8_context	   *oldest = NULL;
+
+		hash_seq_init(&status, plv8_context_hash);
+		while ((entry = (plv8_context_entry *) hash_seq_search(&status)) != NULL)
+		{
+			if (oldest == NULL || entry->context->last_used < oldest->last_used)
+				oldest = entry->context;
+		}
+		plv8_dispose_context(oldest);
+	}
 }
 
 static inline plv8_exec_env *
@@ -404,6 +893,7 @@ plv8_new_exec_env(Isolate *isolate)
 
 	new(&xenv->context) Persistent<Context>();
 	new(&xenv->recv) Persistent<Object>();
+	new(&xenv->generator) Persistent<Object>();
 	xenv->isolate = isolate;
 
 	/*
@@ -478,72 +968,72 @@ Datum
 plv8_reset(PG_FUNCTION_ARGS)
 {
 	Oid					user_id = GetUserId();
-	unsigned long		i;
-	HASH_SEQ_STATUS		status;
-	plv8_proc_cache*	cache;
-
-	for (i = 0; i < ContextVector.size(); i++)
-	{
-		if (ContextVector[i]->user_id == user_id)
-		{
-			plv8_context * context = ContextVector[i];
-			ContextVector.erase(ContextVector.begin() + i);
-			// need to search and reset all the user functions which were created in the old context
-			hash_seq_init(&status, plv8_proc_cache_hash);
-			cache = (plv8_proc_cache *) hash_seq_search(&status);
-			while (cache != nullptr) {
-				if (cache->user_id == user_id) {
-					if (cache->prosrc)
-					{
-						pfree(cache->prosrc);
-						cache->prosrc = NULL;
-					}
-					cache->function.Reset();
-				}
-				cache = (plv8_proc_cache *) hash_seq_search(&status);
-			}
-			context->context.Reset();
-			context->recv_templ.Reset();
-			context->compile_context.Reset();
-			context->plan_template.Reset();
-			context->cursor_template.Reset();
-			context->window_template.Reset();
-			delete context->array_buffer_allocator;
-			context->isolate->Dispose();
-			pfree(context);
-			break;
-		}
-	}
+	plv8_context_entry *entry;
+
+	entry = (plv8_context_entry *)
+		hash_search(plv8_context_hash, &user_id, HASH_FIND, NULL);
+	if (entry != NULL)
+		plv8_dispose_context(entry->context);
+
 	return (Datum) 0;
 }
 
+static Local<v8::Object>
+CacheStatsToValue(Isolate *isolate, plv8_cache_stats *stats)
+{
+	Local<v8::Object>	obj = v8::Object::New(isolate);
+
+	obj->Set(String::NewFromUtf8(isolate, "hits"), Number::New(isolate, stats->hits));
+	obj->Set(String::NewFromUtf8(isolate, "misses"), Number::New(isolate, stats->misses));
+	obj->Set(String::NewFromUtf8(isolate, "rejected"), Number::New(isolate, stats->rejected));
+	return obj;
+}
+
 Datum
 plv8_info(PG_FUNCTION_ARGS)
 {
 	unsigned long		i;
-	unsigned long 		size = ContextVector.size();
+	unsigned long 		size = hash_get_num_entries(plv8_context_hash);
+	plv8_context		*contexts[size];
 	char 				*infos[size];
 	size_t 				lengths[size];
 	size_t 				total_length = 3; // length of "[]\0"
+	HASH_SEQ_STATUS		status;
+	plv8_context_entry	*entry;
+
+	i = 0;
+	hash_seq_init(&status, plv8_context_hash);
+	while ((entry = (plv8_context_entry *) hash_seq_search(&status)) != NULL)
+		contexts[i++] = entry->context;
 
 	for (i = 0; i < size; i++)
 	{
-		Isolate 	   	   *isolate = ContextVector[i]->isolate;
+		Isolate 	   	   *isolate = contexts[i]->isolate;
 		Isolate::Scope		scope(isolate);
 		HandleScope			handle_scope(isolate);
-		Local<Context>		context = ContextVector[i]->localContext();
+		Local<Context>		context = contexts[i]->localContext();
 		Context::Scope		context_scope(context);
 		JSONObject 			JSON;
 		Local<v8::Value>	result;
 		Local<v8::Object>   obj = v8::Object::New(isolate);
 
 #if PG_VERSION_NUM >= 90500
-		char 			   *username = GetUserNameFromId(ContextVector[i]->user_id, false);
+		char 			   *username = GetUserNameFromId(contexts[i]->user_id, false);
 #else
-		char 			   *username = GetUserNameFromId(ContextVector[i]->user_id);
+		char 			   *username = GetUserNameFromId(contexts[i]->user_id);
 #endif
 		obj->Set(String::NewFromUtf8(isolate, "user"), String::NewFromUtf8(isolate, username));
 		GetMemoryInfo(obj);
+		obj->Set(String::NewFromUtf8(isolate, "code_cache"),
+				 CacheStatsToValue(isolate, &contexts[i]->code_cache));
+		obj->Set(String::NewFromUtf8(isolate, "inline_cache"),
+				 CacheStatsToValue(isolate, &contexts[i]->inline_cache));
+		obj->Set(String::NewFromUtf8(isolate, "dialect_cache"),
+				 CacheStatsToValue(isolate, &contexts[i]->dialect_cache));
+		obj->Set(String::NewFromUtf8(isolate, "statement_cache"),
+				 CacheStatsToValue(isolate, &contexts[i]->statement_cache));
+		obj->Set(String::NewFromUtf8(isolate, "plans"),
+				 Int32::New(isolate, list_length(contexts[i]->plans)));
 
 		result = JSON.Stringify(obj);
 		CString str(result);
@@ -587,9 +1077,8 @@ common_pl_inline_handler(PG_FUNCTION_ARGS, Dialect dialect) throw()
 		Persistent<Context> global_context;
 		global_context.Reset(current_context->isolate, current_context->context);
 		
-		Local<Function>	function = CompileFunction(current_context,
-										NULL, 0, NULL,
-										source_text, false, false, dialect);
+		Local<Function>	function = GetInlineFunction(current_context,
+													 source_text, dialect);
 		plv8_exec_env	   *xenv = CreateExecEnv(function, current_context);
 		return CallFunction(fcinfo, xenv, 0, NULL, NULL);
 	}
@@ -599,15 +1088,117 @@ common_pl_inline_handler(PG_FUNCTION_ARGS, Dialect dialect) throw()
 	return (Datum) 0;	// keep compiler quiet
 }
 
-Datum
-plv8_inline_handler(PG_FUNCTION_ARGS)
+/*
+ * Return the compiled function of a DO block, from the inline cache of
+ * context if it has been run before.  Beyond plv8.inline_cache_size, the
+ * least recently used block is dropped.
+ */
+static Local<Function>
+GetInlineFunction(plv8_context *context, const char *source, Dialect dialect)
 {
-	return common_pl_inline_handler(fcinfo, PLV8_DIALECT_NONE);
-}
+	Isolate			   *isolate = context->isolate;
+	plv8_inline_key		key;
+	plv8_inline_cache  *entry = NULL;
+	bool				found;
 
-Datum
-plcoffee_inline_handler(PG_FUNCTION_ARGS)
-{
+	if (plv8_inline_cache_size <= 0)
+		return CompileFunction(context, InvalidOid, NULL, 0, NULL, source,
+							   false, false, dialect);
+
+	memset(&key, 0, sizeof(key));
+	key.hash = DatumGetUInt32(hash_any((const unsigned char *) source,
+									   strlen(source)));
+	key.dialect = dialect;
+
+	PG_TRY();
+	{
+		if (context->inline_functions == NULL)
+		{
+			HASHCTL    hash_ctl = { 0 };
+
+			hash_ctl.keysize = sizeof(plv8_inline_key);
+			hash_ctl.entrysize = sizeof(plv8_inline_cache);
+			hash_ctl.hash = tag_hash;
+			context->inline_functions = hash_create("PLv8 Inline Functions", 64,
+									&hash_ctl, HASH_ELEM | HASH_FUNCTION);
+		}
+		entry = (plv8_inline_cache *)
+			hash_search(context->inline_functions, &key, HASH_FIND, NULL);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (entry != NULL && entry->source != NULL &&
+		strcmp(entry->source, source) == 0)
+	{
+		context->inline_cache.hits++;
+		entry->last_used = ++context_clock;
+		return Local<Function>::New(isolate, entry->function);
+	}
+	context->inline_cache.misses++;
+
+	Local<Function>	function = CompileFunction(context,
+									InvalidOid, NULL, 0, NULL,
+									source, false, false, dialect);
+
+	PG_TRY();
+	{
+		/* evict before entering, so that the new entry stays */
+		while (hash_get_num_entries(context->inline_functions) >= plv8_inline_cache_size)
+		{
+			HASH_SEQ_STATUS		status;
+			plv8_inline_cache  *oldest = NULL;
+
+			hash_seq_init(&status, context->inline_functions);
+			while ((entry = (plv8_inline_cache *) hash_seq_search(&status)) != NULL)
+			{
+				if (oldest == NULL || entry->last_used < oldest->last_used)
+					oldest = entry;
+			}
+			oldest->function.Reset();
+			if (oldest->source)
+				pfree(oldest->source);
+			hash_search(context->inline_functions, &oldest->key, HASH_REMOVE, NULL);
+		}
+
+		entry = (plv8_inline_cache *)
+			hash_search(context->inline_functions, &key, HASH_ENTER, &found);
+		if (!found)
+		{
+			new(&entry->function) Persistent<Function>();
+			entry->source = NULL;
+		}
+		else if (entry->source)
+		{
+			/* a different block with the same hash */
+			pfree(entry->source);
+			entry->source = NULL;
+		}
+		entry->source = MemoryContextStrdup(TopMemoryContext, source);
+		entry->last_used = ++context_clock;
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+	entry->function.Reset(isolate, function);
+
+	return function;
+}
+
+Datum
+plv8_inline_handler(PG_FUNCTION_ARGS)
+{
+	return common_pl_inline_handler(fcinfo, PLV8_DIALECT_NONE);
+}
+
+Datum
+plcoffee_inline_handler(PG_FUNCTION_ARGS)
+{
 	return common_pl_inline_handler(fcinfo, PLV8_DIALECT_COFFEE);
 }
 
@@ -618,111 +1209,359 @@ plls_inline_handler(PG_FUNCTION_ARGS)
 }
 #endif
 
-#ifdef EXECUTION_TIMEOUT
 /*
- * Breakout -- break out of a Call, with a thread
+ * Watchdog -- break out of a Call, with a thread
+ *
+ * One thread per backend, started on first use, watches the outermost
+ * running call and terminates the isolate that is executing when a query
+ * cancel or backend termination is pending, or, when built with
+ * EXECUTION_TIMEOUT, when the call's deadline passes.  Arming and disarming
+ * only take an uncontended lock, so a call pays neither for a thread nor for
+ * installing signal handlers.
  *
- * This function breaks out of a javascript execution context.
+ * PostgreSQL's own signal handlers keep running on the main thread; the
+ * watchdog only reads the flags they set, so the JS loop stops and the
+ * interrupt is then serviced by CHECK_FOR_INTERRUPTS() in DoCall.
+ *
+ * The state is never freed: the thread is detached and lives as long as the
+ * backend does.
  */
-#ifdef _MSC_VER // windows
-DWORD WINAPI
-Breakout (LPVOID lpParam)
+#define WATCHDOG_POLL_INTERVAL		std::chrono::milliseconds(100)
+
+typedef std::chrono::steady_clock watchdog_clock;
+
+typedef enum
 {
-	Isolate *isolate = (Isolate *) lpParam;
-	Sleep(plv8_execution_timeout * 1000);
-	isolate->TerminateExecution();
+	WATCHDOG_IDLE = 0,
+	WATCHDOG_TIMEOUT,
+	WATCHDOG_INTERRUPT
+} WatchdogReason;
+
+typedef struct plv8_watchdog
+{
+	std::mutex					lock;
+	std::condition_variable		cond;
+	Isolate					   *isolate;	/* armed while not NULL */
+	watchdog_clock::time_point	deadline;	/* max() without a timeout */
+	watchdog_clock::time_point	wake_at;	/* max() while idle */
+	WatchdogReason				fired;		/* why the call was stopped */
+} plv8_watchdog;
 
-	return 0;
+static plv8_watchdog   *watchdog = NULL;
+static int				watchdog_depth = 0;
+
+/*
+ * Would the main thread throw an error at its next CHECK_FOR_INTERRUPTS()?
+ * The flags are only read here, and a stale value just delays us by one
+ * poll interval.
+ */
+static inline bool
+InterruptsPending()
+{
+	if (!InterruptPending || InterruptHoldoffCount != 0 || CritSectionCount != 0)
+		return false;
+	return ProcDiePending || (QueryCancelPending && QueryCancelHoldoffCount == 0);
 }
-#else // posix
-void *
-Breakout (void *d)
+
+static void
+WatchdogMain(plv8_watchdog *wd)
 {
-	auto *isolate = (Isolate *) d;
-	sleep(plv8_execution_timeout);
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	isolate->TerminateExecution();
+	std::unique_lock<std::mutex>	guard(wd->lock);
+
+	for (;;)
+	{
+		if (wd->isolate == NULL)
+		{
+			wd->wake_at = watchdog_clock::time_point::max();
+			wd->cond.wait(guard);
+			continue;
+		}
+
+		watchdog_clock::time_point	now = watchdog_clock::now();
+		WatchdogReason	reason = WATCHDOG_IDLE;
+
+		if (InterruptsPending())
+			reason = WATCHDOG_INTERRUPT;
+		else if (now >= wd->deadline)
+			reason = WATCHDOG_TIMEOUT;
+
+		if (reason != WATCHDOG_IDLE)
+		{
+			wd->isolate->TerminateExecution();
+			wd->isolate = NULL;
+			wd->fired = reason;
+			continue;
+		}
 
-	return NULL;
+		wd->wake_at = std::min(wd->deadline, now + WATCHDOG_POLL_INTERVAL);
+		wd->cond.wait_until(guard, wd->wake_at);
+	}
 }
+
+static void
+WatchdogStart()
+{
+	plv8_watchdog  *wd = new plv8_watchdog();
+
+	wd->isolate = NULL;
+	wd->wake_at = watchdog_clock::time_point::max();
+	wd->fired = WATCHDOG_IDLE;
+
+#ifndef WIN32
+	/* keep PostgreSQL's signal handlers on the backend's main thread */
+	sigset_t		all;
+	sigset_t		old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+#endif
+	try
+	{
+		std::thread(WatchdogMain, wd).detach();
+	}
+	catch (std::exception &e)
+	{
+#ifndef WIN32
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+		delete wd;
+		throw js_error("could not start watchdog thread");
+	}
+#ifndef WIN32
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 #endif
+	watchdog = wd;
+}
+
+/*
+ * Arm the watchdog for a call running in isolate, and return the isolate of
+ * the enclosing call (NULL for the outermost one) for WatchdogLeave.  Only
+ * the outermost call sets the deadline; nested calls only redirect it.
+ */
+static Isolate *
+WatchdogEnter(Isolate *isolate)
+{
+	if (watchdog == NULL)
+		WatchdogStart();
+
+	std::lock_guard<std::mutex>	guard(watchdog->lock);
+	Isolate	   *prev = watchdog->isolate;
+
+	if (watchdog_depth++ == 0)
+	{
+		watchdog->fired = WATCHDOG_IDLE;
+		watchdog->deadline = watchdog_clock::time_point::max();
+#ifdef EXECUTION_TIMEOUT
+		if (plv8_execution_timeout > 0)
+			watchdog->deadline = watchdog_clock::now() +
+				std::chrono::seconds(plv8_execution_timeout);
 #endif
-void *int_handler = NULL;
-void *term_handler = NULL;
+		if (watchdog->wake_at == watchdog_clock::time_point::max() ||
+			watchdog->deadline < watchdog->wake_at)
+			watchdog->cond.notify_one();
+	}
+
+	if (watchdog->fired != WATCHDOG_IDLE)
+		isolate->TerminateExecution();
+	else
+		watchdog->isolate = isolate;
+
+	return prev;
+}
+
+/*
+ * Disarm the watchdog, or hand it back to the enclosing call.  Returns why
+ * the call was stopped, if it was; the enclosing call is then terminated as
+ * well.
+ */
+static WatchdogReason
+WatchdogLeave(Isolate *prev)
+{
+	std::lock_guard<std::mutex>	guard(watchdog->lock);
+	WatchdogReason	fired = watchdog->fired;
+
+	watchdog_depth--;
+	if (fired != WATCHDOG_IDLE)
+	{
+		watchdog->isolate = NULL;
+		if (prev != NULL)
+			prev->TerminateExecution();
+	}
+	else
+		watchdog->isolate = prev;
+
+	return fired;
+}
+
+/*
+ * Called at the end of transaction, when no JS can be running anymore.
+ */
+static void
+WatchdogReset()
+{
+	if (watchdog == NULL)
+		return;
+
+	std::lock_guard<std::mutex>	guard(watchdog->lock);
+	watchdog->isolate = NULL;
+	watchdog->fired = WATCHDOG_IDLE;
+	watchdog_depth = 0;
+}
 
 /*
- * signal handler
+ * EnsureSPIConnected -- connect the current call to SPI if not done yet.
  *
- * This function kills the execution of the v8 process if a signal is called
+ * Callers that open a subtransaction must connect before entering it, so
+ * that the connection belongs to the call rather than the subtransaction.
  */
 void
-signal_handler (int sig) {
-	elog(DEBUG1, "cancelling execution");
-	Isolate *isolate = Isolate::GetCurrent();
-	isolate->ThrowException(
-			String::NewFromUtf8(isolate, "Signal caught",
-								NewStringType::kNormal).ToLocalChecked());
+EnsureSPIConnected()
+{
+	/* JS may still run a little before it is terminated */
+	if (spi_pending_error != NULL)
+		throw js_error("current transaction is aborted");
+
+	if (spi_connected)
+		return;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		throw js_error("could not connect to SPI manager");
+	spi_connected = true;
+
+#if PG_VERSION_NUM >= 100000
+	if (spi_trigdata != NULL)
+	{
+		int		status;
+
+		PG_TRY();
+		{
+			status = SPI_register_trigger_data(spi_trigdata);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		if (status < 0)
+			throw js_error(FormatSPIStatus(status));
+	}
+#endif
+}
+
+static MemoryContext
+CreateCallContext()
+{
+	MemoryContext	ctx;
+
+	PG_TRY();
+	{
+#if PG_VERSION_NUM < 110000
+		ctx = AllocSetContextCreate(CurrentMemoryContext,
+									"PLv8 Call Context",
+									ALLOCSET_DEFAULT_MINSIZE,
+									ALLOCSET_DEFAULT_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+#else
+		ctx = AllocSetContextCreate(CurrentMemoryContext,
+									"PLv8 Call Context",
+									ALLOCSET_DEFAULT_SIZES);
+#endif
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return ctx;
 }
 
 /*
  * DoCall -- Call a JS function with SPI support.
  *
+ * The function runs in a memory context of its own, which is deleted when
+ * it returns.  SPI is only connected on first use, so without it whatever
+ * the function allocates before that would stay in the caller's context,
+ * which may live as long as the whole query.  Anything that outlives the
+ * call is allocated in a longer lived context explicitly.
+ *
  * This function could throw C++ exceptions, but must not throw PG exceptions.
  */
 static Local<v8::Value>
 DoCall(Local<Context> ctx, Handle<Function> fn, Handle<Object> receiver,
-	int nargs, Handle<v8::Value> args[])
+	int nargs, Handle<v8::Value> args[], TriggerData *trigdata = NULL)
 {
 	Isolate 	   *isolate = ctx->GetIsolate();
 	TryCatch		try_catch(isolate);
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-	HANDLE  hThread;
-	DWORD dwThreadId;
-#else
-	pthread_t breakout_thread;
-	void *thread_result;
-#endif
-#endif
-
-	if (SPI_connect() != SPI_OK_CONNECT)
-		throw js_error("could not connect to SPI manager");
+	Isolate		   *outer_isolate;
+	WatchdogReason	stopped;
+	bool			outer_spi_connected = spi_connected;
+	TriggerData	   *outer_spi_trigdata = spi_trigdata;
+	int				status = SPI_OK_FINISH;
+	MemoryContext	callcontext = CreateCallContext();
+	MemoryContext	oldcontext;
+
+	outer_isolate = WatchdogEnter(isolate);
+	spi_connected = false;
+	spi_trigdata = trigdata;
+	oldcontext = MemoryContextSwitchTo(callcontext);
+	MaybeLocal<v8::Value> result = fn->Call(ctx, receiver, nargs, args);
+	stopped = WatchdogLeave(outer_isolate);
 
-	// set up the signal handlers
-	int_handler = (void *) signal(SIGINT, signal_handler);
-	term_handler = (void *) signal(SIGTERM, signal_handler);
+	if (spi_pending_error != NULL)
+	{
+		ErrorData	   *edata = spi_pending_error;
 
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER // windows
-	hThread = CreateThread(NULL, 0, Breakout, isolate, 0, &dwThreadId);
-#else
-	// set up the thread to break out the execution if needed
-	pthread_create(&breakout_thread, NULL, Breakout, isolate);
-#endif
-#endif
+		/*
+		 * SPI is left to the abort of the (sub)transaction, which switches
+		 * back to the call context, so that is left to the caller's context.
+		 */
+		MemoryContextSwitchTo(oldcontext);
+		spi_pending_error = NULL;
+		spi_connected = outer_spi_connected;
+		spi_trigdata = outer_spi_trigdata;
+		isolate->CancelTerminateExecution();
 
-	MaybeLocal<v8::Value> result = fn->Call(ctx, receiver, nargs, args);
-	int	status = SPI_finish();
+		PG_TRY();
+		{
+			ReThrowError(edata);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
 
-#ifdef EXECUTION_TIMEOUT
-#ifdef _MSC_VER
-	BOOL cancel_state = TerminateThread(hThread, NULL);
+	if (spi_connected)
+		status = SPI_finish();
+	spi_connected = outer_spi_connected;
+	spi_trigdata = outer_spi_trigdata;
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(callcontext);
 
-	if (cancel_state == 0) {
-		throw js_error("execution timeout exceeded");
-	}
-#else
-	pthread_cancel(breakout_thread);
-	pthread_join(breakout_thread, &thread_result);
+	if (stopped != WATCHDOG_IDLE)
+	{
+		/* the call may have finished just before the termination landed */
+		if (!result.IsEmpty() && outer_isolate != isolate)
+			isolate->CancelTerminateExecution();
 
-	if (thread_result == NULL) {
+		if (stopped == WATCHDOG_INTERRUPT)
+		{
+			PG_TRY();
+			{
+				CHECK_FOR_INTERRUPTS();
+			}
+			PG_CATCH();
+			{
+				throw pg_error();
+			}
+			PG_END_TRY();
+			throw js_error("canceling statement due to user request");
+		}
 		throw js_error("execution timeout exceeded");
 	}
-#endif
-#endif
-
-	signal(SIGINT, (void (*)(int)) int_handler);
-	signal(SIGTERM, (void (*)(int)) term_handler);
 
 	if (result.IsEmpty()) {
 		if (isolate->IsExecutionTerminating())
@@ -849,52 +1688,78 @@ CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	int nargs, plv8_type argtypes[], plv8_type *rettype)
 {
 	plv8_proc		   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc			tupdesc;
 	Tuplestorestate	   *tupstore;
 
+	/* the rest of a set that is being returned value per call */
+	if (!xenv->generator.IsEmpty())
+		return ResumeGenerator(fcinfo, xenv);
+
 	tupstore = CreateTupleStore(fcinfo, &tupdesc);
 
 	Handle<Context>		context = xenv->localContext();
 	Context::Scope		context_scope(context);
 	Converter			conv(tupdesc, proc->functypclass == TYPEFUNC_SCALAR);
 	Handle<v8::Value>	args[FUNC_MAX_ARGS + 1];
+	Handle<v8::Value>	result;
 
-	/*
-	 * In case this is nested via SPI, stash pre-registered converters
-	 * for the previous SRF.
-	 */
-	SRFSupport support(context, &conv, tupstore);
+	{
+		/*
+		 * In case this is nested via SPI, stash pre-registered converters
+		 * for the previous SRF.
+		 */
+		SRFSupport support(context, &conv, tupstore);
 
-	for (int i = 0; i < nargs; i++) {
+		for (int i = 0; i < nargs; i++) {
 #if PG_VERSION_NUM < 120000
-		args[i] = ToValue(fcinfo->arg[i], fcinfo->argnull[i], &argtypes[i]);
+			args[i] = ToValue(fcinfo->arg[i], fcinfo->argnull[i], &argtypes[i]);
 #else
-		args[i] = ToValue(fcinfo->args[i].value, fcinfo->args[i].isnull, &argtypes[i]);
+			args[i] = ToValue(fcinfo->args[i].value, fcinfo->args[i].isnull, &argtypes[i]);
 #endif
-	}
+		}
 
-	Local<Object> recv = Local<Object>::New(xenv->isolate, xenv->recv);
-	Local<Function>		fn =
-		Local<Function>::Cast(recv->GetInternalField(0));
+		Local<Object> recv = Local<Object>::New(xenv->isolate, xenv->recv);
+		Local<Function>		fn =
+			Local<Function>::Cast(recv->GetInternalField(0));
 
-	Handle<v8::Value> result = DoCall(context, fn, recv, nargs, args);
+		result = DoCall(context, fn, recv, nargs, args);
 
-	if (result->IsUndefined())
-	{
-		// no additional values
-	}
-	else if (result->IsArray())
-	{
-		Handle<Array> array = Handle<Array>::Cast(result);
-		// return an array of records.
-		int	length = array->Length();
-		for (int i = 0; i < length; i++)
-			conv.ToDatum(array->Get(i), tupstore);
-	}
-	else
-	{
-		// return a record or a scalar
-		conv.ToDatum(result, tupstore);
+		if (result->IsUndefined())
+		{
+			// no additional values
+		}
+		else if (result->IsArray())
+		{
+			Handle<Array> array = Handle<Array>::Cast(result);
+			// return an array of records.
+			int	length = array->Length();
+			for (int i = 0; i < length; i++)
+				conv.ToDatum(array->Get(i), tupstore);
+		}
+		else if (result->IsGeneratorObject())
+		{
+			/*
+			 * A generator is resumed once per row the executor asks for,
+			 * unless the caller only takes a materialized set, or rows
+			 * were already given to plv8.return_next().
+			 */
+			if ((rsinfo->allowedModes & SFRM_ValuePerCall) &&
+				conv.PutCount() == 0)
+				return StartGenerator(fcinfo, xenv,
+									  Handle<Object>::Cast(result),
+									  tupstore, tupdesc);
+
+			Local<v8::Value>	value;
+
+			while (GeneratorNext(context, Handle<Object>::Cast(result), &value))
+				conv.ToDatum(value, tupstore);
+		}
+		else
+		{
+			// return a record or a scalar
+			conv.ToDatum(result, tupstore);
+		}
 	}
 
 	/* clean up and return the tuplestore */
@@ -903,39 +1768,153 @@ CallSRFunction(PG_FUNCTION_ARGS, plv8_exec_env *xenv,
 	return (Datum) 0;
 }
 
-static Datum
-CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
+/*
+ * Resume generator, and return false once it is done.
+ */
+static bool
+GeneratorNext(Handle<Context> context, Handle<Object> generator,
+			  Local<v8::Value> *value)
 {
-	// trigger arguments are:
-	//	0: NEW
-	//	1: OLD
-	//	2: TG_NAME
-	//	3: TG_WHEN
-	//	4: TG_LEVEL
-	//	5: TG_OP
-	//	6: TG_RELID
-	//	7: TG_TABLE_NAME
-	//	8: TG_TABLE_SCHEMA
-	//	9: TG_ARGV
-	TriggerData		   *trig = (TriggerData *) fcinfo->context;
-	Relation			rel = trig->tg_relation;
-	TriggerEvent		event = trig->tg_event;
-	Handle<v8::Value>	args[10];
-	Datum				result = (Datum) 0;
+	Isolate		   *isolate = context->GetIsolate();
+	Local<v8::Value> next = generator->Get(
+			String::NewFromUtf8(isolate, "next", String::kInternalizedString));
 
-	Handle<Context>		context = xenv->localContext();
+	if (!next->IsFunction())
+		throw js_error("generator has no next()");
+
+	Local<v8::Value> result = DoCall(context, Local<Function>::Cast(next),
+									 generator, 0, NULL);
+	if (!result->IsObject())
+		throw js_error("generator returned a non-object");
+
+	Local<Object> obj = Local<Object>::Cast(result);
+	Local<v8::Value> done = obj->Get(
+			String::NewFromUtf8(isolate, "done", String::kInternalizedString));
+
+	if (done->BooleanValue(context).FromMaybe(true))
+		return false;
+
+	*value = obj->Get(
+			String::NewFromUtf8(isolate, "value", String::kInternalizedString));
+	return true;
+}
+
+/*
+ * Switch a set-returning call from materialize to value-per-call mode, to
+ * return the rows of generator as the executor pulls them.  Nothing of the
+ * set needs to be kept, and the generator is not resumed for the rows a
+ * LIMIT does not take.
+ */
+static Datum
+StartGenerator(PG_FUNCTION_ARGS, plv8_exec_env *xenv, Handle<Object> generator,
+			   Tuplestorestate *tupstore, TupleDesc tupdesc)
+{
+	plv8_proc		   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	PG_TRY();
+	{
+		tuplestore_end(tupstore);
+		rsinfo->returnMode = SFRM_ValuePerCall;
+		rsinfo->setResult = NULL;
+		if (proc->functypclass != TYPEFUNC_SCALAR)
+			tupdesc = BlessTupleDesc(tupdesc);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (proc->functypclass != TYPEFUNC_SCALAR)
+		xenv->generator_conv = new Converter(tupdesc, TopMemoryContext);
+	xenv->generator.Reset(xenv->isolate, generator);
+
+	PG_TRY();
+	{
+		RegisterExprContextCallback(rsinfo->econtext, plv8_release_generator,
+									PointerGetDatum(xenv));
+	}
+	PG_CATCH();
+	{
+		plv8_release_generator(PointerGetDatum(xenv));
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return ResumeGenerator(fcinfo, xenv);
+}
+
+static Datum
+ResumeGenerator(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
+{
+	plv8_proc		   *proc = (plv8_proc *) fcinfo->flinfo->fn_extra;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Local<Context>		context = xenv->localContext();
+	Context::Scope		context_scope(context);
+	Local<Object>		generator = Local<Object>::New(xenv->isolate, xenv->generator);
+	Local<v8::Value>	value;
+
+	if (!GeneratorNext(context, generator, &value))
+	{
+		PG_TRY();
+		{
+			UnregisterExprContextCallback(rsinfo->econtext,
+										  plv8_release_generator,
+										  PointerGetDatum(xenv));
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+		plv8_release_generator(PointerGetDatum(xenv));
+
+		rsinfo->isDone = ExprEndResult;
+		PG_RETURN_NULL();
+	}
+
+	rsinfo->isDone = ExprMultipleResult;
+	if (xenv->generator_conv == NULL)
+		return ToDatum(value, &fcinfo->isnull, &proc->rettype);
+	if (value->IsUndefined() || value->IsNull())
+		PG_RETURN_NULL();
+	return xenv->generator_conv->ToDatum(value);
+}
+
+static Datum
+CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
+{
+	// trigger arguments are:
+	//	0: NEW
+	//	1: OLD
+	//	2: TG_NAME
+	//	3: TG_WHEN
+	//	4: TG_LEVEL
+	//	5: TG_OP
+	//	6: TG_RELID
+	//	7: TG_TABLE_NAME
+	//	8: TG_TABLE_SCHEMA
+	//	9: TG_ARGV
+	TriggerData		   *trig = (TriggerData *) fcinfo->context;
+	Relation			rel = trig->tg_relation;
+	TriggerEvent		event = trig->tg_event;
+	Handle<v8::Value>	args[10];
+	Datum				result = (Datum) 0;
+
+	Handle<Context>		context = xenv->localContext();
 	Context::Scope		context_scope(context);
 
 	if (TRIGGER_FIRED_FOR_ROW(event))
 	{
-		TupleDesc		tupdesc = RelationGetDescr(rel);
-		Converter		conv(tupdesc);
+		std::unique_ptr<Converter>	temp;
+		Converter	   *conv = GetConverter(RelationGetDescr(rel), temp);
 
 		if (TRIGGER_FIRED_BY_INSERT(event))
 		{
 			result = PointerGetDatum(trig->tg_trigtuple);
 			// NEW
-			args[0] = conv.ToValue(trig->tg_trigtuple);
+			args[0] = conv->ToValue(trig->tg_trigtuple);
 			// OLD
 			args[1] = Undefined(xenv->isolate);
 		}
@@ -945,20 +1924,27 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 			// NEW
 			args[0] = Undefined(xenv->isolate);
 			// OLD
-			args[1] = conv.ToValue(trig->tg_trigtuple);
+			args[1] = conv->ToValue(trig->tg_trigtuple);
 		}
 		else if (TRIGGER_FIRED_BY_UPDATE(event))
 		{
 			result = PointerGetDatum(trig->tg_newtuple);
 			// NEW
-			args[0] = conv.ToValue(trig->tg_newtuple);
+			args[0] = conv->ToValue(trig->tg_newtuple);
 			// OLD
-			args[1] = conv.ToValue(trig->tg_trigtuple);
+			args[1] = conv->ToValue(trig->tg_trigtuple);
 		}
 	}
 	else
 	{
 		args[0] = args[1] = Undefined(xenv->isolate);
+#if PG_VERSION_NUM >= 100000
+		/* statement-level triggers get their transition tables instead */
+		if (trig->tg_newtable != NULL && trig->tg_trigger->tgnewtable != NULL)
+			args[0] = CreateTransitionTable(trig->tg_trigger->tgnewtable);
+		if (trig->tg_oldtable != NULL && trig->tg_trigger->tgoldtable != NULL)
+			args[1] = CreateTransitionTable(trig->tg_trigger->tgoldtable);
+#endif
 	}
 
 	// 2: TG_NAME
@@ -1010,7 +1996,7 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 	Local<Function>		fn =
 		Local<Function>::Cast(recv->GetInternalField(0));
 	Handle<v8::Value> newtup =
-		DoCall(context, fn, recv, lengthof(args), args);
+		DoCall(context, fn, recv, lengthof(args), args, trig);
 
 	if (newtup.IsEmpty())
 		throw js_error(try_catch);
@@ -1026,11 +2012,11 @@ CallTrigger(PG_FUNCTION_ARGS, plv8_exec_env *xenv)
 	}
 	else if (!newtup->IsUndefined())
 	{
-		TupleDesc		tupdesc = RelationGetDescr(rel);
-		Converter		conv(tupdesc);
+		std::unique_ptr<Converter>	temp;
+		Converter	   *conv = GetConverter(RelationGetDescr(rel), temp);
 		HeapTupleHeader	header;
 
-		header = DatumGetHeapTupleHeader(conv.ToDatum(newtup));
+		header = DatumGetHeapTupleHeader(conv->ToDatum(newtup));
 
 		/* We know it's there; heap_form_tuple stores with this layout. */
 		result = PointerGetDatum((char *) header - HEAPTUPLESIZE);
@@ -1124,7 +2110,7 @@ plls_call_validator(PG_FUNCTION_ARGS)
 static plv8_proc *
 plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnames) throw()
 {
-	HeapTuple			procTup;
+	HeapTuple			procTup = NULL;
 	plv8_proc_cache	   *cache;
 	bool				found;
 	bool				isnull;
@@ -1133,29 +2119,25 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 	char			   *argmodes;
 	MemoryContext		oldcontext;
 
-	procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
-	if (!HeapTupleIsValid(procTup))
-		elog(ERROR, "cache lookup failed for function %u", fn_oid);
-
 	cache = (plv8_proc_cache *)
-		hash_search(plv8_proc_cache_hash,&fn_oid, HASH_ENTER, &found);
+		hash_search(plv8_proc_cache_hash, &fn_oid, HASH_FIND, NULL);
 
-	if (found)
+	/*
+	 * Changes to pg_proc invalidate entries through plv8_proc_cache_inval,
+	 * so a valid compiled entry is used without looking at the catalog.
+	 * We still need to check user id, as the V8 function is associated
+	 * with the context where it was generated.
+	 */
+	if (cache == NULL || !cache->valid || cache->function.IsEmpty() ||
+		cache->user_id != GetUserId())
 	{
-		bool	uptodate;
+		procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
+		if (!HeapTupleIsValid(procTup))
+			elog(ERROR, "cache lookup failed for function %u", fn_oid);
 
-		/*
-		 * We need to check user id and dispose it if it's different from
-		 * the previous cache user id, as the V8 function is associated
-		 * with the context where it was generated.  In most cases,
-		 * we can expect this doesn't affect runtime performance.
-		 */
-		uptodate = (!cache->function.IsEmpty() &&
-			cache->fn_xmin == HeapTupleHeaderGetXmin(procTup->t_data) &&
-			ItemPointerEquals(&cache->fn_tid, &procTup->t_self) &&
-			cache->user_id == GetUserId());
-
-		if (!uptodate)
+		cache = (plv8_proc_cache *)
+			hash_search(plv8_proc_cache_hash, &fn_oid, HASH_ENTER, &found);
+		if (found)
 		{
 			if (cache->prosrc)
 			{
@@ -1166,19 +2148,24 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 		}
 		else
 		{
-			ReleaseSysCache(procTup);
+			new(&cache->function) Persistent<Function>();
+			cache->prosrc = NULL;
 		}
-	}
-	else
-	{
-		new(&cache->function) Persistent<Function>();
-		cache->prosrc = NULL;
+
+		/* From here on, invalidations of the row clear it again. */
+		cache->valid = true;
 	}
 
 	if (cache->function.IsEmpty())
 	{
 		Form_pg_proc	procStruct;
 
+		if (procTup == NULL)
+		{
+			procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
+			if (!HeapTupleIsValid(procTup))
+				elog(ERROR, "cache lookup failed for function %u", fn_oid);
+		}
 		procStruct = (Form_pg_proc) GETSTRUCT(procTup);
 
 		prosrc = SysCacheGetAttr(PROCOID, procTup, Anum_pg_proc_prosrc, &isnull);
@@ -1191,6 +2178,9 @@ plv8_get_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, char ***argnam
 		strlcpy(cache->proname, NameStr(procStruct->proname), NAMEDATALEN);
 		cache->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
 		cache->fn_tid = procTup->t_self;
+#if PG_VERSION_NUM >= 90200
+		cache->hashvalue = GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(fn_oid));
+#endif
 		cache->user_id = GetUserId();
 
 		int nargs = get_func_arg_info(procTup, &argtypes, argnames, &argmodes);
@@ -1331,7 +2321,26 @@ CreateExecEnv(Handle<Function> function, plv8_context *context)
 	return xenv;
 }
 
-/* Source transformation from a dialect (coffee or ls) to js */
+/*
+ * Hash of a dialect compiler, as the key of its translations in the
+ * persistent cache.
+ */
+static uint32
+DialectCompilerHash(Dialect dialect, const char *binary_data)
+{
+	static uint32	hashes[PLV8_DIALECT_LIVESCRIPT + 1];
+
+	if (hashes[dialect] == 0)
+		hashes[dialect] = DatumGetUInt32(hash_any(
+				(const unsigned char *) binary_data, strlen(binary_data)));
+	return hashes[dialect];
+}
+
+/*
+ * Source transformation from a dialect (coffee or ls) to js.  With
+ * plv8.code_cache, the result is kept in the persistent cache, and the
+ * compiler is only loaded when it is not found there.
+ */
 static char *
 CompileDialect(const char *src, Dialect dialect, plv8_context *global_context)
 {
@@ -1362,6 +2371,29 @@ CompileDialect(const char *src, Dialect dialect, plv8_context *global_context)
 			throw js_error("Unknown Dialect");
 	}
 
+	if (plv8_code_cache)
+	{
+		PG_TRY();
+		{
+			MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+			cresult = plv8_dialect_cache_read(dialect,
+							DialectCompilerHash(dialect, dialect_binary_data), src);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		if (cresult != NULL)
+		{
+			global_context->dialect_cache.hits++;
+			return cresult;
+		}
+		global_context->dialect_cache.misses++;
+	}
+
 	if (ctx->Global()->Get(key)->IsUndefined())
 	{
 		HandleScope		handle_scope(isolate);
@@ -1402,6 +2434,10 @@ CompileDialect(const char *src, Dialect dialect, plv8_context *global_context)
 		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
 		cresult = pstrdup(result.str());
 		MemoryContextSwitchTo(oldcontext);
+
+		if (plv8_code_cache)
+			plv8_dialect_cache_write(dialect,
+					DialectCompilerHash(dialect, dialect_binary_data), src, cresult);
 	}
 	PG_CATCH();
 	{
@@ -1453,6 +2489,7 @@ Compile(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger,
 		global_context.Reset(current_context->isolate, current_context->context);
 		cache->function.Reset(current_context->isolate, CompileFunction(
 						current_context,
+						cache->fn_oid,
 						cache->proname,
 						cache->nargs,
 						(const char **) argnames,
@@ -1465,9 +2502,14 @@ Compile(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger,
 	return proc;
 }
 
+/*
+ * fn_oid identifies the function for the code cache; pass InvalidOid for
+ * code that has no pg_proc entry.
+ */
 static Local<Function>
 CompileFunction(
 	plv8_context *global_context,
+	Oid fn_oid,
 	const char *proname,
 	int proarglen,
 	const char *proargs[],
@@ -1522,6 +2564,13 @@ CompileFunction(
 	else
 		name = Undefined(isolate);
 	Local<String> source = ToString(src.data, src.len);
+	/*
+	 * V8 only checks the length of the source when it accepts a code cache,
+	 * and the xmin of the pg_proc row does not tell apart versions written
+	 * by one transaction, or frozen ones, so the whole source is the key.
+	 */
+	uint32		src_hash = DatumGetUInt32(hash_any((const unsigned char *) src.data,
+												   src.len));
 	pfree(src.data);
 
 	Local<Context> context = Local<Context>::New(isolate, global_context->context);
@@ -1529,12 +2578,54 @@ CompileFunction(
 	TryCatch		try_catch(isolate);
 	v8::ScriptOrigin origin(name);
 	v8::Local<v8::Script> script;
-  if (!Script::Compile(isolate->GetCurrentContext(), source, &origin).ToLocal(&script))
+	bool			use_code_cache = plv8_code_cache && OidIsValid(fn_oid);
+	bool			store_code_cache = use_code_cache;
+	char		   *cache_data = NULL;
+	int				cache_length = 0;
+	ScriptCompiler::CachedData *cached = NULL;
+
+	if (use_code_cache)
+	{
+		PG_TRY();
+		{
+			cache_data = plv8_code_cache_read(fn_oid, src_hash, &cache_length);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		if (cache_data != NULL)
+			cached = new ScriptCompiler::CachedData(
+					(const uint8_t *) cache_data, cache_length);
+		else
+			global_context->code_cache.misses++;
+	}
+
+	/* script_source takes the ownership of cached, but not of cache_data */
+	ScriptCompiler::Source script_source(source, origin, cached);
+
+	if (!ScriptCompiler::Compile(isolate->GetCurrentContext(), &script_source,
+			cached ? ScriptCompiler::kConsumeCodeCache
+				   : ScriptCompiler::kNoCompileOptions).ToLocal(&script))
 		throw js_error(try_catch);
 
 	if (script.IsEmpty())
 		throw js_error(try_catch);
 
+	if (cached)
+	{
+		if (script_source.GetCachedData()->rejected)
+			global_context->code_cache.rejected++;
+		else
+		{
+			global_context->code_cache.hits++;
+			store_code_cache = false;
+		}
+		pfree(cache_data);
+	}
+
 	v8::Local<v8::Value> result;
 	if (!script->Run(isolate->GetCurrentContext()).ToLocal(&result))
 		throw js_error(try_catch);
@@ -1544,6 +2635,32 @@ CompileFunction(
 		throw js_error(try_catch);
 	}
 
+	/*
+	 * Create the cache after running the script, so that it includes the
+	 * function, which V8 compiles eagerly as it is parenthesized.
+	 */
+	if (store_code_cache)
+	{
+		ScriptCompiler::CachedData *data =
+			ScriptCompiler::CreateCodeCache(script->GetUnboundScript());
+
+		if (data != NULL)
+		{
+			PG_TRY();
+			{
+				plv8_code_cache_write(fn_oid, src_hash,
+									  (const char *) data->data, data->length);
+			}
+			PG_CATCH();
+			{
+				delete data;
+				throw pg_error();
+			}
+			PG_END_TRY();
+			delete data;
+		}
+	}
+
 	return handle_scope.Escape(Local<Function>::Cast(result));
 }
 
@@ -1662,152 +2779,276 @@ charToText(char *string)
 	return result;
 }
 
-static plv8_context*
-GetPlv8Context() {
-	Oid					user_id = GetUserId();
-	unsigned int		i;
-	plv8_context		*my_context = nullptr;
+/*
+ * Templates created with each context, in the order they are stored in a
+ * startup snapshot.
+ */
+static Persistent<ObjectTemplate> plv8_context::* const ContextTemplates[] = {
+	&plv8_context::recv_templ,
+	&plv8_context::plan_template,
+	&plv8_context::cursor_template,
+	&plv8_context::window_template,
+	&plv8_context::iterator_template,
+};
+
+/* Internal fields of the objects of recv_templ, the receiver of a function */
+#define PLV8_RECV_FIELDS	1
+
+/*
+ * Key of the snapshots made by this build.  A snapshot refers to native
+ * functions by their index in the external references, and stores the
+ * templates above, which the code restoring it relies on, so it must only
+ * be used by a build with the same versions, references and layout.
+ */
+static uint32
+GetSnapshotKey()
+{
+	StringInfoData	buf;
+	uint32			key;
+
+	PG_TRY();
+	{
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s %s %d %d recv:%d ", V8::GetVersion(),
+						 PLV8_VERSION, GetExternalReferenceCount(),
+						 (int) lengthof(ContextTemplates), PLV8_RECV_FIELDS);
+		GetTemplateLayout(&buf);
+		key = DatumGetUInt32(hash_any((const unsigned char *) buf.data, buf.len));
+		pfree(buf.data);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return key;
+}
+
+static void
+CreateContextTemplates(plv8_context *context)
+{
+	Isolate					   *isolate = context->isolate;
+	HandleScope					handle_scope(isolate);
+	Local<ObjectTemplate>		templ;
+	Local<FunctionTemplate>		base;
+
+	templ = ObjectTemplate::New(isolate);
+	templ->SetInternalFieldCount(PLV8_RECV_FIELDS);
+	context->recv_templ.Reset(isolate, templ);
+
+	base = FunctionTemplate::New(isolate);
+	base->SetClassName(String::NewFromUtf8(isolate, "PreparedPlan", String::kInternalizedString));
+	templ = base->InstanceTemplate();
+	SetupPrepFunctions(templ);
+	context->plan_template.Reset(isolate, templ);
+
+	base = FunctionTemplate::New(isolate);
+	base->SetClassName(String::NewFromUtf8(isolate, "Cursor", String::kInternalizedString));
+	templ = base->InstanceTemplate();
+	SetupCursorFunctions(templ);
+	context->cursor_template.Reset(isolate, templ);
+
+	base = FunctionTemplate::New(isolate);
+	base->SetClassName(String::NewFromUtf8(isolate, "WindowObject", String::kInternalizedString));
+	templ = base->InstanceTemplate();
+	SetupWindowFunctions(templ);
+	context->window_template.Reset(isolate, templ);
+
+	base = FunctionTemplate::New(isolate);
+	base->SetClassName(String::NewFromUtf8(isolate, "ResultIterator", String::kInternalizedString));
+	templ = base->InstanceTemplate();
+	SetupIteratorFunctions(templ);
+	context->iterator_template.Reset(isolate, templ);
+}
 
-	for (i = 0; i < ContextVector.size(); i++)
+/*
+ * Set up the handles of a new context.  With a snapshot, the global context
+ * and the templates are deserialized, otherwise they are built from scratch.
+ */
+static void
+InitContext(plv8_context *context, Oid user_id, bool from_snapshot)
+{
+	Isolate 			   *isolate = context->isolate;
+	HandleScope				handle_scope(isolate);
+
+	new(&context->context) Persistent<Context>();
+	new(&context->recv_templ) Persistent<ObjectTemplate>();
+	new(&context->compile_context) Persistent<Context>();
+	new(&context->plan_template) Persistent<ObjectTemplate>();
+	new(&context->cursor_template) Persistent<ObjectTemplate>();
+	new(&context->window_template) Persistent<ObjectTemplate>();
+	new(&context->iterator_template) Persistent<ObjectTemplate>();
+	context->user_id = user_id;
+	context->inline_functions = NULL;
+	context->converters = NULL;
+	context->retired_converters = NIL;
+	context->row_functions = NULL;
+	context->statements = NULL;
+	context->plans = NIL;
+	memset(&context->code_cache, 0, sizeof(plv8_cache_stats));
+	memset(&context->inline_cache, 0, sizeof(plv8_cache_stats));
+	memset(&context->dialect_cache, 0, sizeof(plv8_cache_stats));
+	memset(&context->statement_cache, 0, sizeof(plv8_cache_stats));
+
+	if (from_snapshot)
 	{
-		if (ContextVector[i]->user_id == user_id)
+		Local<Context>	ctx;
+
+		if (!Context::FromSnapshot(isolate, 0).ToLocal(&ctx))
+			throw js_error("could not create context from snapshot");
+		context->context.Reset(isolate, ctx);
+
+		for (size_t i = 0; i < lengthof(ContextTemplates); i++)
 		{
-			my_context = ContextVector[i];
-			break;
+			Local<ObjectTemplate>	templ;
+
+			if (!isolate->GetDataFromSnapshotOnce<ObjectTemplate>(i).ToLocal(&templ))
+				throw js_error("could not restore templates from snapshot");
+			(context->*ContextTemplates[i]).Reset(isolate, templ);
 		}
 	}
-	if (!my_context)
+	else
 	{
-		my_context = (plv8_context *) MemoryContextAlloc(TopMemoryContext,
-														 sizeof(plv8_context));
-		CreateIsolate(my_context);
-		Isolate 			   *isolate = my_context->isolate;
-		Isolate::Scope			scope(isolate);
-		HandleScope				handle_scope(isolate);
-
 		Local<ObjectTemplate>	global = Local<ObjectTemplate>::New(isolate, GetGlobalObjectTemplate(isolate));
-		
-		new(&my_context->context) Persistent<Context>();
-		my_context->context.Reset(isolate, Context::New(isolate, NULL, global));
-		my_context->user_id = user_id;
 
-		new(&my_context->recv_templ) Persistent<ObjectTemplate>();
-		Local<ObjectTemplate> templ = ObjectTemplate::New(isolate);
-		templ->SetInternalFieldCount(1);
-		my_context->recv_templ.Reset(isolate, templ);
-
-		new(&my_context->compile_context) Persistent<Context>();
-		Local<Context> ctx = Context::New(isolate, (ExtensionConfiguration*)NULL);
-		my_context->compile_context.Reset(isolate, ctx);
-
-		new(&my_context->plan_template) Persistent<ObjectTemplate>();
-		Local<FunctionTemplate> base = FunctionTemplate::New(isolate);
-		base->SetClassName(String::NewFromUtf8(isolate, "PreparedPlan", String::kInternalizedString));
-		templ = base->InstanceTemplate();
-		SetupPrepFunctions(templ);
-		my_context->plan_template.Reset(isolate, templ);
-
-		new(&my_context->cursor_template) Persistent<ObjectTemplate>();
-		base = FunctionTemplate::New(isolate);
-		base->SetClassName(String::NewFromUtf8(isolate, "Cursor", String::kInternalizedString));
-		templ = base->InstanceTemplate();
-		SetupCursorFunctions(templ);
-		my_context->cursor_template.Reset(isolate, templ);
-
-		new(&my_context->window_template) Persistent<ObjectTemplate>();
-		base = FunctionTemplate::New(isolate);
-		base->SetClassName(String::NewFromUtf8(isolate, "WindowObject", String::kInternalizedString));
-		templ = base->InstanceTemplate();
-		SetupWindowFunctions(templ);
-		my_context->window_template.Reset(isolate, templ);
-		/*
-		 * Need to register it before running any code, as the code
-		 * recursively may want to the global context.
-		 */
-		ContextVector.push_back(my_context);
+		context->context.Reset(isolate, Context::New(isolate, NULL, global));
+		CreateContextTemplates(context);
+	}
 
-		/*
-		 * Run the start up procedure if configured.
-		 */
-		if (plv8_start_proc != NULL)
-		{
-			Local<Function>		func;
+	Local<Context> ctx = Context::New(isolate, (ExtensionConfiguration*)NULL);
+	context->compile_context.Reset(isolate, ctx);
+}
+
+/*
+ * Run the start up procedure if configured.
+ */
+static void
+RunStartProc(plv8_context *my_context)
+{
+	Isolate 			   *isolate = my_context->isolate;
+
+	if (plv8_start_proc != NULL)
+	{
+		Local<Function>		func;
 
-			HandleScope			handle_scope(isolate);
-			Local<Context>		context = my_context->localContext();
-			Context::Scope		context_scope(context);
-			TryCatch			try_catch(isolate);
-			MemoryContext		ctx = CurrentMemoryContext;
-			text *arg;
+		HandleScope			handle_scope(isolate);
+		Local<Context>		context = my_context->localContext();
+		Context::Scope		context_scope(context);
+		TryCatch			try_catch(isolate);
+		MemoryContext		ctx = CurrentMemoryContext;
+		text *arg;
 #if PG_VERSION_NUM < 120000
-			FunctionCallInfoData fake_fcinfo;
+		FunctionCallInfoData fake_fcinfo;
 #else
-			// Stack-allocate FunctionCallInfoBaseData with
-			// space for 2 arguments:
-			LOCAL_FCINFO(fake_fcinfo, 2);
+		// Stack-allocate FunctionCallInfoBaseData with
+		// space for 2 arguments:
+		LOCAL_FCINFO(fake_fcinfo, 2);
 #endif
-			FmgrInfo	flinfo;
+		FmgrInfo	flinfo;
 
-			char perm[16];
-			strcpy(perm, "EXECUTE");
-			arg = charToText(perm);
+		char perm[16];
+		strcpy(perm, "EXECUTE");
+		arg = charToText(perm);
 
-			PG_TRY();
-					{
-						Oid funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin, CStringGetDatum(plv8_start_proc)));
+		PG_TRY();
+				{
+					Oid funcoid = DatumGetObjectId(DirectFunctionCall1(regprocin, CStringGetDatum(plv8_start_proc)));
 #if PG_VERSION_NUM < 120000
-						MemSet(&fake_fcinfo, 0, sizeof(fake_fcinfo));
-						MemSet(&flinfo, 0, sizeof(flinfo));
-						fake_fcinfo.flinfo = &flinfo;
-						flinfo.fn_oid = InvalidOid;
-						flinfo.fn_mcxt = CurrentMemoryContext;
-						fake_fcinfo.nargs = 2;
-						fake_fcinfo.arg[0] = ObjectIdGetDatum(funcoid);
-						fake_fcinfo.arg[1] = CStringGetDatum(arg);
-						Datum ret = has_function_privilege_id(&fake_fcinfo);
+					MemSet(&fake_fcinfo, 0, sizeof(fake_fcinfo));
+					MemSet(&flinfo, 0, sizeof(flinfo));
+					fake_fcinfo.flinfo = &flinfo;
+					flinfo.fn_oid = InvalidOid;
+					flinfo.fn_mcxt = CurrentMemoryContext;
+					fake_fcinfo.nargs = 2;
+					fake_fcinfo.arg[0] = ObjectIdGetDatum(funcoid);
+					fake_fcinfo.arg[1] = CStringGetDatum(arg);
+					Datum ret = has_function_privilege_id(&fake_fcinfo);
 #else
-						MemSet(&flinfo, 0, sizeof(flinfo));
-				fake_fcinfo->flinfo = &flinfo;
-				flinfo.fn_oid = InvalidOid;
-				flinfo.fn_mcxt = CurrentMemoryContext;
-				fake_fcinfo->nargs = 2;
-				fake_fcinfo->args[0].value = ObjectIdGetDatum(funcoid);
-				fake_fcinfo->args[1].value = CStringGetDatum(arg);
-				Datum ret = has_function_privilege_id(fake_fcinfo);
+					MemSet(&flinfo, 0, sizeof(flinfo));
+			fake_fcinfo->flinfo = &flinfo;
+			flinfo.fn_oid = InvalidOid;
+			flinfo.fn_mcxt = CurrentMemoryContext;
+			fake_fcinfo->nargs = 2;
+			fake_fcinfo->args[0].value = ObjectIdGetDatum(funcoid);
+			fake_fcinfo->args[1].value = CStringGetDatum(arg);
+			Datum ret = has_function_privilege_id(fake_fcinfo);
 #endif
 
-						if (ret == 0) {
-							elog(WARNING, "failed to find js function %s", plv8_start_proc);
+					if (ret == 0) {
+						elog(WARNING, "failed to find js function %s", plv8_start_proc);
+					} else {
+						if (DatumGetBool(ret)) {
+							func = find_js_function(funcoid);
 						} else {
-							if (DatumGetBool(ret)) {
-								func = find_js_function(funcoid);
-							} else {
-								elog(WARNING, "no permission to execute js function %s", plv8_start_proc);
-							}
+							elog(WARNING, "no permission to execute js function %s", plv8_start_proc);
 						}
 					}
-				PG_CATCH();
-					{
-						ErrorData	   *edata;
-
-						MemoryContextSwitchTo(ctx);
-						edata = CopyErrorData();
-						elog(WARNING, "failed to find js function %s", edata->message);
-						FlushErrorState();
-						FreeErrorData(edata);
-					}
-			PG_END_TRY();
+				}
+			PG_CATCH();
+				{
+					ErrorData	   *edata;
 
-			pfree(arg);
+					MemoryContextSwitchTo(ctx);
+					edata = CopyErrorData();
+					elog(WARNING, "failed to find js function %s", edata->message);
+					FlushErrorState();
+					FreeErrorData(edata);
+				}
+		PG_END_TRY();
 
-			if (!func.IsEmpty())
-			{
-				Handle<v8::Value>	result =
-						DoCall(context, func, my_context->localContext()->Global(), 0, NULL);
-				if (result.IsEmpty())
-					throw js_error(try_catch);
-			}
+		pfree(arg);
+
+		if (!func.IsEmpty())
+		{
+			Handle<v8::Value>	result =
+					DoCall(context, func, my_context->localContext()->Global(), 0, NULL);
+			if (result.IsEmpty())
+				throw js_error(try_catch);
 		}
+	}
+}
+
+static plv8_context*
+GetPlv8Context() {
+	Oid					user_id = GetUserId();
+	plv8_context		*my_context = nullptr;
+	plv8_context_entry	*entry;
+	bool				found;
+
+	/* everything runs in the context being saved while creating a snapshot */
+	if (snapshot_context != NULL)
+		return snapshot_context;
+
+	entry = (plv8_context_entry *)
+		hash_search(plv8_context_hash, &user_id, HASH_FIND, &found);
+	if (found)
+		my_context = entry->context;
+	else
+	{
+		StartupData		   *snapshot = plv8_use_snapshot ? plv8_load_snapshot() : NULL;
+
+		InitializeV8();
+		my_context = (plv8_context *) MemoryContextAlloc(TopMemoryContext,
+														 sizeof(plv8_context));
+		CreateIsolate(my_context, snapshot);
+		Isolate 			   *isolate = my_context->isolate;
+		Isolate::Scope			scope(isolate);
+		HandleScope				handle_scope(isolate);
+
+		InitContext(my_context, user_id, snapshot != NULL);
+
+		/*
+		 * Need to register it before running any code, as the code
+		 * recursively may want to the global context.
+		 */
+		entry = (plv8_context_entry *)
+			hash_search(plv8_context_hash, &user_id, HASH_ENTER, NULL);
+		entry->context = my_context;
+
+		/* The snapshot already has the state start_proc left behind. */
+		if (snapshot == NULL)
+			RunStartProc(my_context);
 
 #ifdef ENABLE_DEBUGGER_SUPPORT
 		debug_message_context = v8::Persistent<v8::Context>::New(global_context);
@@ -1819,13 +3060,218 @@ GetPlv8Context() {
 		v8::Debug::EnableAgent("plv8", plv8_debugger_port, false);
 #endif  // ENABLE_DEBUGGER_SUPPORT
 	}
+	my_context->last_used = ++context_clock;
 	return my_context;
 }
 
-static Local<ObjectTemplate>
-GetGlobalObjectTemplate(Isolate *isolate)
+static StartupData *
+plv8_load_snapshot()
 {
-	Persistent<ObjectTemplate>	global;
+	MemoryContext	oldcontext;
+	char		   *data;
+	int				length;
+
+	if (snapshot_blob != NULL)
+		return snapshot_blob;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	data = plv8_cache_read(PLV8_SNAPSHOT_NAME, GetSnapshotKey(), &length);
+	if (data != NULL)
+	{
+		snapshot_blob = (StartupData *) palloc(sizeof(StartupData));
+		snapshot_blob->data = data;
+		snapshot_blob->raw_size = length;
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	return snapshot_blob;
+}
+
+/*
+ * V8 refuses to create a snapshot while any handles are alive, so drop
+ * everything the snapshot context and the functions compiled in it hold.
+ */
+static void
+ReleaseSnapshotHandles(plv8_context *context, plv8_exec_env *envs)
+{
+	HASH_SEQ_STATUS		status;
+	plv8_proc_cache	   *cache;
+
+	hash_seq_init(&status, plv8_proc_cache_hash);
+	while ((cache = (plv8_proc_cache *) hash_seq_search(&status)) != NULL)
+		cache->function.Reset();
+
+	for (plv8_exec_env *env = envs; env != NULL; env = env->next)
+	{
+		env->recv.Reset();
+		env->context.Reset();
+		plv8_release_generator(PointerGetDatum(env));
+	}
+
+	context->context.Reset();
+	context->compile_context.Reset();
+	for (size_t i = 0; i < lengthof(ContextTemplates); i++)
+		(context->*ContextTemplates[i]).Reset();
+	plv8_release_inline_cache(context);
+	plv8_release_converters(context, false);
+	plv8_release_row_functions(context);
+	plv8_release_statements(context);
+	plv8_release_plans(context);
+}
+
+/*
+ * Invalidations during CreateSnapshot only reach the snapshot's procedure
+ * cache, so the regular one is revalidated afterwards.
+ */
+static void
+InvalidateAllProcs()
+{
+#if PG_VERSION_NUM >= 90200
+	plv8_proc_cache_inval((Datum) 0, PROCOID, 0);
+#else
+	plv8_proc_cache_inval((Datum) 0, PROCOID, NULL);
+#endif
+}
+
+/*
+ * CreateSnapshot -- save a context, after start_proc has run, as a V8
+ * startup snapshot and return its size.
+ *
+ * While the snapshot context is set up, all plv8 calls of this backend run
+ * in it, with their own procedure cache, so that nothing compiled for the
+ * snapshot isolate leaks into the regular contexts.
+ */
+static int
+CreateSnapshot()
+{
+	plv8_context	   *context;
+	plv8_context	   *saved_context = current_context;
+	HTAB			   *saved_hash = plv8_proc_cache_hash;
+	plv8_exec_env	   *saved_envs = exec_env_head;
+	HTAB			   *hash;
+	StartupData			blob;
+
+	InitializeV8();
+
+	PG_TRY();
+	{
+		context = (plv8_context *) palloc(sizeof(plv8_context));
+		hash = plv8_create_proc_cache_hash("PLv8 Snapshot Procedures");
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	{
+		SnapshotCreator		creator(GetExternalReferences());
+		Isolate			   *isolate = creator.GetIsolate();
+
+		/*
+		 * The creator sets up the isolate with an array buffer allocator of
+		 * its own, and owns it; it cannot be given ours.
+		 */
+		SetIsolateLimits(isolate);
+		context->isolate = isolate;
+		context->array_buffer_allocator = NULL;
+		plv8_proc_cache_hash = hash;
+		exec_env_head = NULL;
+		snapshot_context = context;
+		current_context = context;
+
+		try
+		{
+			{
+				HandleScope		handle_scope(isolate);
+
+				InitContext(context, GetUserId(), false);
+				RunStartProc(context);
+
+				creator.SetDefaultContext(Context::New(isolate));
+				creator.AddContext(context->localContext());
+				for (size_t i = 0; i < lengthof(ContextTemplates); i++)
+					creator.AddData(Local<ObjectTemplate>::New(isolate,
+											context->*ContextTemplates[i]));
+			}
+
+			/*
+			 * A plan points into this backend, which V8 cannot serialize, so
+			 * the plans that garbage collection does not free are an error.
+			 */
+			isolate->LowMemoryNotification();
+			if (context->plans != NIL)
+				throw js_error("start_proc must not leave prepared plans reachable");
+			ReleaseSnapshotHandles(context, exec_env_head);
+			blob = creator.CreateBlob(SnapshotCreator::FunctionCodeHandling::kKeep);
+		}
+		catch (...)
+		{
+			ReleaseSnapshotHandles(context, exec_env_head);
+			plv8_proc_cache_hash = saved_hash;
+			exec_env_head = saved_envs;
+			snapshot_context = NULL;
+			current_context = saved_context;
+			hash_destroy(hash);
+			InvalidateAllProcs();
+			throw;
+		}
+
+		plv8_proc_cache_hash = saved_hash;
+		exec_env_head = saved_envs;
+		snapshot_context = NULL;
+		current_context = saved_context;
+		hash_destroy(hash);
+		InvalidateAllProcs();
+	}
+
+	if (blob.data == NULL)
+		throw js_error("could not create snapshot");
+
+	PG_TRY();
+	{
+		plv8_cache_write(PLV8_SNAPSHOT_NAME, GetSnapshotKey(),
+						 blob.data, blob.raw_size);
+	}
+	PG_CATCH();
+	{
+		delete[] blob.data;
+		throw pg_error();
+	}
+	PG_END_TRY();
+	delete[] blob.data;
+
+	return blob.raw_size;
+}
+
+/*
+ * plv8_create_snapshot() -- save the state after plv8.start_proc as the
+ * startup snapshot for new contexts, see plv8.use_snapshot.
+ */
+Datum
+plv8_create_snapshot(PG_FUNCTION_ARGS)
+{
+	int		size = 0;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to create a plv8 snapshot")));
+
+	try
+	{
+		size = CreateSnapshot();
+	}
+	catch (js_error& e)	{ e.rethrow(); }
+	catch (pg_error& e)	{ e.rethrow(); }
+
+	PG_RETURN_INT64(size);
+}
+
+static Local<ObjectTemplate>
+GetGlobalObjectTemplate(Isolate *isolate)
+{
+	Persistent<ObjectTemplate>	global;
 
 	if (global.IsEmpty())
 	{
@@ -1867,12 +3313,186 @@ get_plv8_type(PG_FUNCTION_ARGS, int argno)
 	return &proc->argtypes[argno];
 }
 
+/*
+ * The context that owns isolate.  This is usually current_context, but that
+ * is left pointing to the callee's context after a call into a function of
+ * another user returns.
+ */
+plv8_context *
+IsolateContext(Isolate *isolate)
+{
+	HASH_SEQ_STATUS		status;
+	plv8_context_entry *entry;
+
+	if (current_context != NULL && current_context->isolate == isolate)
+		return current_context;
+
+	hash_seq_init(&status, plv8_context_hash);
+	while ((entry = (plv8_context_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->context->isolate == isolate)
+		{
+			hash_seq_term(&status);
+			return entry->context;
+		}
+	}
+
+	throw js_error("no plv8 context for the current isolate");
+}
+
+static void
+RetireConverter(plv8_context *context, Converter *conv)
+{
+	PG_TRY();
+	{
+		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		context->retired_converters = lappend(context->retired_converters, conv);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PG_CATCH();
+	{
+		/* leak it rather than free one that may still be in use */
+		throw pg_error();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Get a Converter for tupdesc that is kept in the current context, so that
+ * the column types and names of a row type are looked up once rather than
+ * per row, such as for every row of a trigger or every composite value.
+ *
+ * The Converter has its own copy of tupdesc, and must not be deleted by
+ * the caller.  An anonymous record type without a typmod cannot be told
+ * apart from others, so its Converter is not kept but given to temp, and
+ * is deleted when the caller's temp goes out of scope.
+ */
+Converter *
+GetConverter(TupleDesc tupdesc, std::unique_ptr<Converter> &temp)
+{
+	plv8_context		   *context = IsolateContext(Isolate::GetCurrent());
+	plv8_converter_key		key;
+	plv8_converter_cache   *entry;
+	Converter			   *conv;
+	bool					found;
+
+	if (tupdesc->tdtypeid == RECORDOID && tupdesc->tdtypmod < 0)
+	{
+		temp.reset(new Converter(tupdesc, CurrentMemoryContext));
+		return temp.get();
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.typid = tupdesc->tdtypeid;
+	key.typmod = tupdesc->tdtypmod;
+
+	PG_TRY();
+	{
+		if (context->converters == NULL)
+		{
+			HASHCTL    hash_ctl = { 0 };
+
+			hash_ctl.keysize = sizeof(plv8_converter_key);
+			hash_ctl.entrysize = sizeof(plv8_converter_cache);
+			hash_ctl.hash = tag_hash;
+			context->converters = hash_create("PLv8 Converters", 64,
+									&hash_ctl, HASH_ELEM | HASH_FUNCTION);
+		}
+
+		entry = (plv8_converter_cache *)
+			hash_search(context->converters, &key, HASH_ENTER, &found);
+		if (!found)
+			entry->converter = NULL;
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (entry->converter != NULL)
+	{
+		if (entry->converter->Matches(tupdesc))
+			return entry->converter;
+
+		conv = entry->converter;
+		entry->converter = NULL;
+		RetireConverter(context, conv);
+	}
+
+	entry->converter = new Converter(tupdesc, TopMemoryContext);
+
+	return entry->converter;
+}
+
+/*
+ * Get a Converter for something that lives until the end of the transaction
+ * at the latest, such as the rows of a cursor.  The Converter has its own
+ * copy of tupdesc, and is deleted at the end of the transaction unless it
+ * is released earlier by ReleaseTransactionConverter().
+ */
+Converter *
+NewTransactionConverter(TupleDesc tupdesc)
+{
+	plv8_context   *context = IsolateContext(Isolate::GetCurrent());
+	Converter	   *conv = new Converter(tupdesc, TopMemoryContext);
+
+	try
+	{
+		RetireConverter(context, conv);
+	}
+	catch (pg_error& e)
+	{
+		delete conv;
+		throw;
+	}
+
+	return conv;
+}
+
+/*
+ * Delete a Converter of NewTransactionConverter() in the same transaction.
+ */
+void
+ReleaseTransactionConverter(Converter *conv)
+{
+	plv8_context   *context = IsolateContext(Isolate::GetCurrent());
+
+	context->retired_converters =
+		list_delete_ptr(context->retired_converters, conv);
+	delete conv;
+}
+
+static MemoryContext
+CreateConverterContext(MemoryContext parent)
+{
+#if PG_VERSION_NUM < 110000
+	return AllocSetContextCreate(parent,
+								 "ConverterContext",
+								 ALLOCSET_SMALL_MINSIZE,
+								 ALLOCSET_SMALL_INITSIZE,
+								 ALLOCSET_SMALL_MAXSIZE);
+#else
+	return AllocSetContextCreate(parent,
+								 "ConverterContext",
+								 ALLOCSET_DEFAULT_SIZES);
+#endif
+}
+
 Converter::Converter(TupleDesc tupdesc) :
 	m_tupdesc(tupdesc),
 	m_colnames(tupdesc->natts),
 	m_coltypes(tupdesc->natts),
 	m_is_scalar(false),
-	m_memcontext(NULL)
+	m_memcontext(NULL),
+	m_values(NULL),
+	m_nulls(NULL),
+	m_rowcontext(NULL),
+	m_rowvalues(NULL),
+	m_rownulls(NULL),
+	m_putting(false),
+	m_nputs(0)
 {
 	Init();
 }
@@ -1882,13 +3502,22 @@ Converter::Converter(TupleDesc tupdesc, bool is_scalar) :
 	m_colnames(tupdesc->natts),
 	m_coltypes(tupdesc->natts),
 	m_is_scalar(is_scalar),
-	m_memcontext(NULL)
+	m_memcontext(NULL),
+	m_values(NULL),
+	m_nulls(NULL),
+	m_rowcontext(NULL),
+	m_rowvalues(NULL),
+	m_rownulls(NULL),
+	m_putting(false),
+	m_nputs(0)
 {
 	Init();
 }
 
 Converter::~Converter()
 {
+	m_rowfunc.Reset();
+
 	if (m_memcontext != NULL)
 	{
 		MemoryContext ctx = CurrentMemoryContext;
@@ -1913,38 +3542,86 @@ Converter::~Converter()
 	}
 }
 
+/*
+ * A Converter that may outlive tupdesc, see GetConverter().  The tupdesc
+ * is copied into the Converter's own memory context, under parent.
+ */
+Converter::Converter(TupleDesc tupdesc, MemoryContext parent) :
+	m_tupdesc(NULL),
+	m_colnames(tupdesc->natts),
+	m_coltypes(tupdesc->natts),
+	m_is_scalar(false),
+	m_memcontext(NULL),
+	m_values(NULL),
+	m_nulls(NULL),
+	m_rowcontext(NULL),
+	m_rowvalues(NULL),
+	m_rownulls(NULL),
+	m_putting(false),
+	m_nputs(0)
+{
+	PG_TRY();
+	{
+		MemoryContext	oldcontext;
+
+		m_memcontext = CreateConverterContext(parent);
+		oldcontext = MemoryContextSwitchTo(m_memcontext);
+		/* keep the missing values of columns added with a default */
+		m_tupdesc = CreateTupleDescCopyConstr(tupdesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	Init();
+}
+
+/*
+ * Whether the Converter still fits tupdesc, which is of the same row type.
+ * A relation or composite type may have been altered since it was built.
+ */
+bool
+Converter::Matches(TupleDesc tupdesc)
+{
+	if (tupdesc->natts != m_tupdesc->natts)
+		return false;
+
+	for (int c = 0; c < m_tupdesc->natts; c++)
+	{
+		Form_pg_attribute	a = TupleDescAttr(m_tupdesc, c);
+		Form_pg_attribute	b = TupleDescAttr(tupdesc, c);
+
+		if (a->atttypid != b->atttypid || a->atttypmod != b->atttypmod ||
+			a->attisdropped != b->attisdropped ||
+			strcmp(NameStr(a->attname), NameStr(b->attname)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
 void
 Converter::Init()
 {
+	Isolate	   *isolate = Isolate::GetCurrent();
+
 	for (int c = 0; c < m_tupdesc->natts; c++)
 	{
 		if (TupleDescAttr(m_tupdesc, c)->attisdropped)
 			continue;
 
-		m_colnames[c] = ToString(NameStr(TupleDescAttr(m_tupdesc, c)->attname));
+		m_colnames[c].Reset(isolate, ToInternalizedString(NameStr(TupleDescAttr(m_tupdesc, c)->attname)));
 
 		PG_TRY();
 		{
 			if (m_memcontext == NULL)
-#if PG_VERSION_NUM < 110000
-				m_memcontext = AllocSetContextCreate(
-									CurrentMemoryContext,
-									"ConverterContext",
-									ALLOCSET_SMALL_MINSIZE,
-									ALLOCSET_SMALL_INITSIZE,
-									ALLOCSET_SMALL_MAXSIZE);
-			plv8_fill_type(&m_coltypes[c],
-						   m_tupdesc->attrs[c]->atttypid,
-						   m_memcontext);
-#else
-				m_memcontext = AllocSetContextCreate(
-									CurrentMemoryContext,
-									"ConverterContext",
-									ALLOCSET_DEFAULT_SIZES);
+				m_memcontext = CreateConverterContext(CurrentMemoryContext);
 			plv8_fill_type(&m_coltypes[c],
-						   m_tupdesc->attrs[c].atttypid,
+						   TupleDescAttr(m_tupdesc, c)->atttypid,
 						   m_memcontext);
-#endif
 		}
 		PG_CATCH();
 		{
@@ -1952,35 +3629,386 @@ Converter::Init()
 		}
 		PG_END_TRY();
 	}
+
+	/*
+	 * Tuples are deformed into these in one pass; heap_getattr per column
+	 * would walk all the preceding columns again once there is a varlena
+	 * or null one.
+	 */
+	if (m_memcontext != NULL)
+	{
+		PG_TRY();
+		{
+			m_values = (Datum *) MemoryContextAlloc(m_memcontext,
+									sizeof(Datum) * m_tupdesc->natts);
+			m_nulls = (bool *) MemoryContextAlloc(m_memcontext,
+									sizeof(bool) * m_tupdesc->natts);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+}
+
+/*
+ * Get the constructor of rows with the given column names, which are
+ * separated by '\0' in names:
+ *
+ *   function(v0, v1, ...) { this[n[0]] = v0; this[n[1]] = v1; ... }
+ *
+ * Every column is set by the constructor, so that rows share one hidden
+ * class with in-object fields, instead of growing a property backing store
+ * per row.  The constructor is kept in
+ * the context, so that the rows of every query with the same columns share
+ * that class, and user code reading them stays monomorphic.  The rows get
+ * the initial Object.prototype, which is passed in rather than looked up
+ * through the global Object that JS may have replaced.
+ */
+static Local<Function>
+GetRowFunction(plv8_context *global_context, const char *names, int length,
+			   int ncols)
+{
+	Isolate				   *isolate = global_context->isolate;
+	Local<Context>			context = isolate->GetCurrentContext();
+	EscapableHandleScope	handle_scope(isolate);
+	TryCatch				try_catch(isolate);
+	uint32					hash;
+	plv8_row_function	   *entry = NULL;
+	bool					found;
+	StringInfoData			buf;
+
+	PG_TRY();
+	{
+		hash = DatumGetUInt32(hash_any((const unsigned char *) names, length));
+		if (global_context->row_functions == NULL)
+		{
+			HASHCTL    hash_ctl = { 0 };
+
+			hash_ctl.keysize = sizeof(uint32);
+			hash_ctl.entrysize = sizeof(plv8_row_function);
+			hash_ctl.hash = tag_hash;
+			global_context->row_functions = hash_create("PLv8 Row Functions", 64,
+									&hash_ctl, HASH_ELEM | HASH_FUNCTION);
+		}
+		entry = (plv8_row_function *)
+			hash_search(global_context->row_functions, &hash, HASH_FIND, NULL);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (entry != NULL && entry->names != NULL && entry->length == length &&
+		memcmp(entry->names, names, length) == 0)
+	{
+		entry->last_used = ++context_clock;
+		return handle_scope.Escape(Local<Function>::New(isolate, entry->function));
+	}
+
+	Local<Array>	array = Array::New(isolate, ncols);
+
+	for (int i = 0, offset = 0; i < ncols; i++)
+	{
+		array->Set(i, ToString(names + offset));
+		offset += strlen(names + offset) + 1;
+	}
+
+	PG_TRY();
+	{
+		initStringInfo(&buf);
+		appendStringInfoString(&buf, "(function(n,p){var f=function(");
+		for (int i = 0; i < ncols; i++)
+			appendStringInfo(&buf, i == 0 ? "v%d" : ",v%d", i);
+		appendStringInfoString(&buf, "){");
+		for (int i = 0; i < ncols; i++)
+			appendStringInfo(&buf, "this[n[%d]]=v%d;", i, i);
+		appendStringInfoString(&buf, "};f.prototype=p;return f;})");
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	Local<Script>		script;
+	Local<v8::Value>	factory;
+	Local<v8::Value>	func;
+	Handle<v8::Value>	args[2] = { array, Object::New(isolate)->GetPrototype() };
+
+	if (!Script::Compile(context, ToString(buf.data, buf.len)).ToLocal(&script) ||
+		!script->Run(context).ToLocal(&factory) ||
+		!Local<Function>::Cast(factory)->Call(context, Undefined(isolate), 2, args).ToLocal(&func))
+		throw js_error(try_catch);
+	pfree(buf.data);
+
+	PG_TRY();
+	{
+		/* evict before entering, so that the new entry stays */
+		while (hash_get_num_entries(global_context->row_functions) >= PLV8_ROW_FUNCTIONS)
+		{
+			HASH_SEQ_STATUS		status;
+			plv8_row_function  *oldest = NULL;
+
+			hash_seq_init(&status, global_context->row_functions);
+			while ((entry = (plv8_row_function *) hash_seq_search(&status)) != NULL)
+			{
+				if (oldest == NULL || entry->last_used < oldest->last_used)
+					oldest = entry;
+			}
+			oldest->function.Reset();
+			if (oldest->names)
+				pfree(oldest->names);
+			hash_search(global_context->row_functions, &oldest->hash,
+						HASH_REMOVE, NULL);
+		}
+
+		entry = (plv8_row_function *)
+			hash_search(global_context->row_functions, &hash, HASH_ENTER, &found);
+		if (!found)
+		{
+			new(&entry->function) Persistent<Function>();
+			entry->names = NULL;
+		}
+		else if (entry->names)
+		{
+			/* other columns with the same hash */
+			pfree(entry->names);
+			entry->names = NULL;
+		}
+		entry->names = (char *) MemoryContextAlloc(TopMemoryContext,
+												   Max(length, 1));
+		memcpy(entry->names, names, length);
+		entry->length = length;
+		entry->last_used = ++context_clock;
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+	entry->function.Reset(isolate, Local<Function>::Cast(func));
+
+	return handle_scope.Escape(Local<Function>::Cast(func));
+}
+
+void
+Converter::InitRowFunction()
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
+	HandleScope		handle_scope(isolate);
+	StringInfoData	names;
+	int				ncols = 0;
+
+	PG_TRY();
+	{
+		initStringInfo(&names);
+		for (int c = 0; c < m_tupdesc->natts; c++)
+		{
+			Form_pg_attribute	attr = TupleDescAttr(m_tupdesc, c);
+
+			if (attr->attisdropped)
+				continue;
+			appendBinaryStringInfo(&names, NameStr(attr->attname),
+								   strlen(NameStr(attr->attname)) + 1);
+			ncols++;
+		}
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	m_rowfunc.Reset(isolate, GetRowFunction(IsolateContext(isolate),
+											names.data, names.len, ncols));
+	pfree(names.data);
+	m_rowargs.resize(ncols);
 }
 
-// TODO: use prototype instead of per tuple fields to reduce
-// memory consumption.
 Local<Object>
 Converter::ToValue(HeapTuple tuple)
 {
 	Isolate		   *isolate = Isolate::GetCurrent();
-	Local<Object>	obj = Object::New(isolate);
+	Local<Context>	context = isolate->GetCurrentContext();
+	Local<Object>	obj;
+	Local<Function>	rowfunc;
+	TryCatch		try_catch(isolate);
 
-	for (int c = 0; c < m_tupdesc->natts; c++)
-	{
-		Datum		datum;
-		bool		isnull;
+	/* every row of the Converter is made by the constructor, to share a shape */
+	if (m_rowfunc.IsEmpty())
+		InitRowFunction();
+	rowfunc = Local<Function>::New(isolate, m_rowfunc);
 
+	/* m_values is only missing when every column is dropped */
+	if (m_values != NULL)
+		heap_deform_tuple(tuple, m_tupdesc, m_values, m_nulls);
+
+	for (int c = 0, i = 0; c < m_tupdesc->natts; c++)
+	{
 		if (TupleDescAttr(m_tupdesc, c)->attisdropped)
 			continue;
 
-#if PG_VERSION_NUM >= 90000
-		datum = heap_getattr(tuple, c + 1, m_tupdesc, &isnull);
-#else
-		/*
-		 * Due to the difference between C and C++ rules,
-		 * we cannot call heap_getattr from < 9.0 unfortunately.
-		 */
-		datum = nocachegetattr(tuple, c + 1, m_tupdesc, &isnull);
+		m_rowargs[i++] = ::ToValue(m_values[c], m_nulls[c], &m_coltypes[c]);
+	}
+
+	if (!rowfunc->NewInstance(context, m_rowargs.size(),
+							  m_rowargs.data()).ToLocal(&obj))
+		throw js_error(try_catch);
+
+	return obj;
+}
+
+/*
+ * The width of the elements of the typed array that holds a column without
+ * nulls, if it is of a fixed-width numeric type, or 0 otherwise.
+ */
+static size_t
+TypedArrayWidth(Oid typid)
+{
+	switch (typid)
+	{
+	case INT2OID:
+	case INT4OID:
+		return sizeof(int32);
+	case FLOAT4OID:
+	case FLOAT8OID:
+		return sizeof(double);
+#if !BIGINT_GRACEFUL
+	case INT8OID:
+		return sizeof(int64);
 #endif
+	default:
+		return 0;
+	}
+}
+
+static void
+SetTypedArrayElement(Oid typid, void *data, int index, Datum value)
+{
+	switch (typid)
+	{
+	case INT2OID:
+		((int32 *) data)[index] = DatumGetInt16(value);
+		break;
+	case INT4OID:
+		((int32 *) data)[index] = DatumGetInt32(value);
+		break;
+	case FLOAT4OID:
+		((double *) data)[index] = DatumGetFloat4(value);
+		break;
+	case FLOAT8OID:
+		((double *) data)[index] = DatumGetFloat8(value);
+		break;
+	case INT8OID:
+		((int64 *) data)[index] = DatumGetInt64(value);
+		break;
+	}
+}
+
+static Local<TypedArray>
+NewTypedArray(Oid typid, Local<ArrayBuffer> buffer, int length)
+{
+	switch (typid)
+	{
+	case INT2OID:
+	case INT4OID:
+		return Int32Array::New(buffer, 0, length);
+	case INT8OID:
+		return BigInt64Array::New(buffer, 0, length);
+	default:
+		return Float64Array::New(buffer, 0, length);
+	}
+}
+
+/*
+ * Convert the tuples into an object of an array per column.  Each tuple is
+ * deformed once, straight into the columns.  A column of a fixed-width
+ * numeric type is filled as a typed array, which becomes a plain array
+ * from the first null on.
+ */
+Local<Object>
+Converter::ToColumns(HeapTuple *tuples, int ntuples)
+{
+	Isolate							   *isolate = Isolate::GetCurrent();
+	Local<Object>						obj = Object::New(isolate);
+	int									natts = m_tupdesc->natts;
+	std::vector< Local<ArrayBuffer> >	buffers(natts);
+	std::vector< Local<Array> >			arrays(natts);
+	std::vector< void * >				data(natts, (void *) NULL);
+
+	for (int c = 0; c < natts; c++)
+	{
+		Oid		typid = TupleDescAttr(m_tupdesc, c)->atttypid;
+		size_t	width = TypedArrayWidth(typid);
+
+		if (TupleDescAttr(m_tupdesc, c)->attisdropped)
+			continue;
+
+		if (width > 0)
+			buffers[c] = ArrayBuffer::New(isolate, (size_t) ntuples * width);
+		if (!buffers[c].IsEmpty())
+			data[c] = buffers[c]->GetContents().Data();
+		else
+			arrays[c] = Array::New(isolate, ntuples);
+	}
+
+	/* m_values is only missing when every column is dropped */
+	for (int r = 0; r < ntuples && m_values != NULL; r++)
+	{
+		PG_TRY();
+		{
+			heap_deform_tuple(tuples[r], m_tupdesc, m_values, m_nulls);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+
+		for (int c = 0; c < natts; c++)
+		{
+			Oid		typid = TupleDescAttr(m_tupdesc, c)->atttypid;
+
+			if (TupleDescAttr(m_tupdesc, c)->attisdropped)
+				continue;
+
+			if (data[c] != NULL && m_nulls[c])
+			{
+				/* copy the rows so far out of the typed array */
+				Local<TypedArray>	typed = NewTypedArray(typid, buffers[c], r);
+
+				arrays[c] = Array::New(isolate, ntuples);
+				for (int i = 0; i < r; i++)
+					arrays[c]->Set(i, typed->Get(i));
+				data[c] = NULL;
+				buffers[c].Clear();
+			}
+
+			if (data[c] != NULL)
+				SetTypedArrayElement(typid, data[c], r, m_values[c]);
+			else
+				arrays[c]->Set(r, ::ToValue(m_values[c], m_nulls[c],
+											&m_coltypes[c]));
+		}
+	}
+
+	for (int c = 0; c < natts; c++)
+	{
+		Local<v8::Value>	column;
+
+		if (TupleDescAttr(m_tupdesc, c)->attisdropped)
+			continue;
+
+		if (data[c] != NULL)
+			column = NewTypedArray(TupleDescAttr(m_tupdesc, c)->atttypid,
+								   buffers[c], ntuples);
+		else
+			column = arrays[c];
 
-		obj->Set(m_colnames[c], ::ToValue(datum, isnull, &m_coltypes[c]));
+		obj->Set(Local<String>::New(isolate, m_colnames[c]), column);
 	}
 
 	return obj;
@@ -2003,6 +4031,16 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 			throw js_error(try_catch);
 	}
 
+	if (tupstore)
+		m_nputs++;
+
+	/* rows of a set go through the reused buffers, unless nested */
+	if (tupstore && m_memcontext != NULL && !m_putting)
+	{
+		PutValues(value, obj, tupstore);
+		return (Datum) 0;
+	}
+
 	/*
 	 * Use vector<char> instead of vector<bool> because <bool> version is
 	 * s specialized and different from bool[].
@@ -2010,30 +4048,96 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 	Datum  *values = (Datum *) palloc(sizeof(Datum) * m_tupdesc->natts);
 	bool   *nulls = (bool *) palloc(sizeof(bool) * m_tupdesc->natts);
 
-	if (!m_is_scalar)
+	FillDatums(value, obj, values, nulls);
+
+	if (tupstore)
 	{
-		Handle<Array> names = obj->GetPropertyNames(isolate->GetCurrentContext()).ToLocalChecked();
+		tuplestore_putvalues(tupstore, m_tupdesc, values, nulls);
+		result = (Datum) 0;
+	}
+	else
+	{
+		result = HeapTupleGetDatum(heap_form_tuple(m_tupdesc, values, nulls));
+	}
 
-		for (int c = 0; c < m_tupdesc->natts; c++)
-		{
-			if (TupleDescAttr(m_tupdesc, c)->attisdropped)
-				continue;
+	pfree(values);
+	pfree(nulls);
 
-			bool found = false;
-			CString  colname(m_colnames[c]);
-			for (int d = 0; d < m_tupdesc->natts; d++)
-			{
-				CString fname(names->Get(d));
-				if (strcmp(colname, fname) == 0)
-				{
-					found = true;
-					break;
-				}
-			}
-			if (!found)
-				throw js_error("field name / property name mismatch");
+	return result;
+}
+
+/*
+ * Put a row into tupstore.  The datums are made in a per-row memory
+ * context that is reset once the tuplestore has its own copy, so that
+ * detoasted or converted values do not pile up over the rows of a set.
+ */
+void
+Converter::PutValues(Handle<v8::Value> value, Handle<Object> obj,
+					 Tuplestorestate *tupstore)
+{
+	MemoryContext	oldcontext;
+
+	if (m_rowcontext == NULL)
+	{
+		PG_TRY();
+		{
+			m_rowcontext = AllocSetContextCreate(m_memcontext,
+												 "ConverterRowContext",
+#if PG_VERSION_NUM < 110000
+												 ALLOCSET_SMALL_MINSIZE,
+												 ALLOCSET_SMALL_INITSIZE,
+												 ALLOCSET_SMALL_MAXSIZE);
+#else
+												 ALLOCSET_DEFAULT_SIZES);
+#endif
+			m_rowvalues = (Datum *) MemoryContextAlloc(m_memcontext,
+									sizeof(Datum) * m_tupdesc->natts);
+			m_rownulls = (bool *) MemoryContextAlloc(m_memcontext,
+									sizeof(bool) * m_tupdesc->natts);
 		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+
+	/*
+	 * The row context is not reset on error, as the error may still refer
+	 * to memory in it; the next row resets it.
+	 */
+	m_putting = true;
+	oldcontext = MemoryContextSwitchTo(m_rowcontext);
+	try
+	{
+		FillDatums(value, obj, m_rowvalues, m_rownulls);
+	}
+	catch (...)
+	{
+		MemoryContextSwitchTo(oldcontext);
+		m_putting = false;
+		throw;
+	}
+	MemoryContextSwitchTo(oldcontext);
+	m_putting = false;
+
+	PG_TRY();
+	{
+		tuplestore_putvalues(tupstore, m_tupdesc, m_rowvalues, m_rownulls);
+		MemoryContextReset(m_rowcontext);
 	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+}
+
+void
+Converter::FillDatums(Handle<v8::Value> value, Handle<Object> obj,
+					  Datum *values, bool *nulls)
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
 
 	for (int c = 0; c < m_tupdesc->natts; c++)
 	{
@@ -2048,27 +4152,23 @@ Converter::ToDatum(Handle<v8::Value> value, Tuplestorestate *tupstore)
 			continue;
 		}
 
-		Handle<v8::Value> attr = m_is_scalar ? value : obj->Get(m_colnames[c]);
+		Local<String>	colname = Local<String>::New(isolate, m_colnames[c]);
+		Handle<v8::Value> attr = m_is_scalar ? value : obj->Get(colname);
+
+		/*
+		 * Every column must be a property of the object.  The column names
+		 * are internalized, so the lookups are cheap, and only a property
+		 * that reads as undefined needs to be told apart from a missing one.
+		 */
+		if (!m_is_scalar && !attr.IsEmpty() && attr->IsUndefined() &&
+			!obj->Has(isolate->GetCurrentContext(), colname).FromMaybe(false))
+			throw js_error("field name / property name mismatch");
+
 		if (attr.IsEmpty() || attr->IsUndefined() || attr->IsNull())
 			nulls[c] = true;
 		else
 			values[c] = ::ToDatum(attr, &nulls[c], &m_coltypes[c]);
 	}
-
-	if (tupstore)
-	{
-		tuplestore_putvalues(tupstore, m_tupdesc, values, nulls);
-		result = (Datum) 0;
-	}
-	else
-	{
-		result = HeapTupleGetDatum(heap_form_tuple(m_tupdesc, values, nulls));
-	}
-
-	pfree(values);
-	pfree(nulls);
-
-	return result;
 }
 
 js_error::js_error() throw()
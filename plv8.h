@@ -14,6 +14,7 @@
 #include <v8-debug.h>
 #endif  // ENABLE_DEBUGGER_SUPPORT
 #include <v8-version-string.h>
+#include <memory>
 #include <vector>
 
 extern "C" {
@@ -21,7 +22,10 @@ extern "C" {
 
 #include "access/htup.h"
 #include "fmgr.h"
+#include "lib/stringinfo.h"
 #include "mb/pg_wchar.h"
+#include "nodes/pg_list.h"
+#include "utils/hsearch.h"
 #include "utils/tuplestore.h"
 #include "windowapi.h"
 }
@@ -105,6 +109,16 @@ typedef struct plv8_type
 	plv8_external_array_type ext_array;
 } plv8_type;
 
+/*
+ * Hit counters of a cache, reported by plv8_info().
+ */
+typedef struct plv8_cache_stats
+{
+	uint64		hits;
+	uint64		misses;
+	uint64		rejected;		/* found, but unusable */
+} plv8_cache_stats;
+
 /*
  * For the security reasons, the global context is separated
  * between users and it's associated with user id.
@@ -119,8 +133,20 @@ typedef struct plv8_context
 	v8::Persistent<v8::ObjectTemplate>  plan_template;
 	v8::Persistent<v8::ObjectTemplate>  cursor_template;
 	v8::Persistent<v8::ObjectTemplate>  window_template;
+	v8::Persistent<v8::ObjectTemplate>  iterator_template;
 	v8::Local<v8::Context> localContext() { return v8::Local<v8::Context>::New(isolate, context) ; }
 	Oid							user_id;
+	uint64						last_used;	/* for LRU disposal */
+	HTAB					   *inline_functions;	/* compiled DO blocks */
+	HTAB					   *converters;			/* Converters by row type */
+	HTAB					   *row_functions;		/* row constructors */
+	List					   *retired_converters;	/* freed at end of xact */
+	HTAB					   *statements;			/* plans of plv8.execute() */
+	List					   *plans;				/* plans of plv8.prepare() */
+	plv8_cache_stats			code_cache;
+	plv8_cache_stats			inline_cache;
+	plv8_cache_stats			dialect_cache;
+	plv8_cache_stats			statement_cache;
 } plv8_context;
 
 /*
@@ -155,24 +181,47 @@ class Converter
 {
 private:
 	TupleDesc								m_tupdesc;
-	std::vector< v8::Handle<v8::String> >	m_colnames;
+	std::vector< v8::Global<v8::String> >	m_colnames;
 	std::vector< plv8_type >				m_coltypes;
 	bool									m_is_scalar;
 	MemoryContext							m_memcontext;
+	Datum								   *m_values;
+	bool								   *m_nulls;
+	MemoryContext							m_rowcontext;
+	Datum								   *m_rowvalues;
+	bool								   *m_rownulls;
+	bool									m_putting;
+	v8::Persistent<v8::Function>			m_rowfunc;
+	std::vector< v8::Local<v8::Value> >		m_rowargs;
+	int64									m_nputs;
 
 public:
 	Converter(TupleDesc tupdesc);
 	Converter(TupleDesc tupdesc, bool is_scalar);
+	Converter(TupleDesc tupdesc, MemoryContext parent);
 	~Converter();
+	bool	Matches(TupleDesc tupdesc);
+	int64	PutCount() const { return m_nputs; }
 	v8::Local<v8::Object> ToValue(HeapTuple tuple);
+	v8::Local<v8::Object> ToColumns(HeapTuple *tuples, int ntuples);
 	Datum	ToDatum(v8::Handle<v8::Value> value, Tuplestorestate *tupstore = NULL);
 
 private:
 	Converter(const Converter&);
 	Converter& operator = (const Converter&);
 	void	Init();
+	void	InitRowFunction();
+	void	FillDatums(v8::Handle<v8::Value> value, v8::Handle<v8::Object> obj,
+					   Datum *values, bool *nulls);
+	void	PutValues(v8::Handle<v8::Value> value, v8::Handle<v8::Object> obj,
+					  Tuplestorestate *tupstore);
 };
 
+extern Converter *GetConverter(TupleDesc tupdesc,
+							   std::unique_ptr<Converter> &temp);
+extern Converter *NewTransactionConverter(TupleDesc tupdesc);
+extern void ReleaseTransactionConverter(Converter *conv);
+
 /*
  * Provide JavaScript JSON object functionality.
  */
@@ -271,9 +320,15 @@ public:
 };
 
 extern plv8_context* current_context;
+extern uint64 plv8_xact_count;
+extern int plv8_statement_cache_size;
+extern bool plv8_execute_subtransaction;
+extern ErrorData *spi_pending_error;
+extern plv8_context *IsolateContext(v8::Isolate *isolate);
 extern v8::Local<v8::Function> find_js_function(Oid fn_oid);
 extern v8::Local<v8::Function> find_js_function_by_name(const char *signature);
 extern const char *FormatSPIStatus(int status) throw();
+extern void EnsureSPIConnected();
 extern plv8_type *get_plv8_type(PG_FUNCTION_ARGS, int argno);
 
 // plv8_type.cc
@@ -283,18 +338,36 @@ extern Datum ToDatum(v8::Handle<v8::Value> value, bool *isnull, plv8_type *type)
 extern v8::Local<v8::Value> ToValue(Datum datum, bool isnull, plv8_type *type);
 extern v8::Local<v8::String> ToString(Datum value, plv8_type *type);
 extern v8::Local<v8::String> ToString(const char *str, int len = -1, int encoding = GetDatabaseEncoding());
+extern v8::Local<v8::String> ToInternalizedString(const char *str);
 extern char *ToCString(const v8::String::Utf8Value &value);
 extern char *ToCStringCopy(const v8::String::Utf8Value &value);
 
 // plv8_func.cc
 extern v8::Handle<v8::Function> CreateYieldFunction(Converter *conv, Tuplestorestate *tupstore);
 extern void Subtransaction(const v8::FunctionCallbackInfo<v8::Value>& info) throw();
+#if PG_VERSION_NUM >= 100000
+extern v8::Local<v8::Object> CreateTransitionTable(const char *name);
+#endif
+extern void plv8_release_statements(plv8_context *context);
+extern void plv8_release_plans(plv8_context *context);
 
 extern void SetupPlv8Functions(v8::Handle<v8::ObjectTemplate> plv8);
 extern void SetupPrepFunctions(v8::Handle<v8::ObjectTemplate> templ);
 extern void SetupCursorFunctions(v8::Handle<v8::ObjectTemplate> templ);
 extern void SetupWindowFunctions(v8::Handle<v8::ObjectTemplate> templ);
+extern void SetupIteratorFunctions(v8::Handle<v8::ObjectTemplate> templ);
 
 extern void GetMemoryInfo(v8::Local<v8::Object> obj);
+extern const intptr_t *GetExternalReferences();
+extern int GetExternalReferenceCount();
+extern void GetTemplateLayout(StringInfo buf);
+
+// plv8_cache.cc
+extern char *plv8_cache_read(const char *name, uint32 key, int *length);
+extern void plv8_cache_write(const char *name, uint32 key, const char *data, int length);
+extern char *plv8_code_cache_read(Oid fn_oid, uint32 src_hash, int *length);
+extern void plv8_code_cache_write(Oid fn_oid, uint32 src_hash, const char *data, int length);
+extern char *plv8_dialect_cache_read(Dialect dialect, uint32 compiler, const char *src);
+extern void plv8_dialect_cache_write(Dialect dialect, uint32 compiler, const char *src, const char *js);
 
 #endif	// _PLV8_
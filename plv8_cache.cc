@@ -0,0 +1,242 @@
+/*-------------------------------------------------------------------------
+ *
+ * plv8_cache.cc : PL/v8 persistent compilation caches.
+ *
+ * Copyright (c) 2009-2012, the PLV8JS Development Group.
+ *-------------------------------------------------------------------------
+ */
+#include "plv8.h"
+
+extern "C" {
+#include "miscadmin.h"
+#include "storage/fd.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+
+#include <sys/stat.h>
+#include <unistd.h>
+} // extern "C"
+
+/*
+ * Cache entries are plain files under the data directory, one per entry,
+ * shared by every backend of the cluster.  Each file starts with a header
+ * that records the V8 version and a caller supplied key, so that an entry
+ * written by a different V8 or for an older version of the source is
+ * ignored.  V8 validates code cache data on its own as well, so a stale or
+ * damaged entry is never more than a cache miss.
+ *
+ * Entries are written to a temporary file first and renamed into place, so
+ * concurrent readers never see a partial file.  An entry is named after what
+ * it is for, not its version, so a newer version replaces it, and one found
+ * stale is removed.  Entries of dropped functions are left behind, and the
+ * directory may be removed at any time.
+ */
+#define PLV8_CACHE_DIR		"plv8_cache"
+#define PLV8_CACHE_MAGIC	0x706c7638		/* "plv8" */
+
+typedef struct plv8_cache_header
+{
+	uint32		magic;
+	uint32		key;
+	uint32		length;
+	char		v8_version[32];
+} plv8_cache_header;
+
+static void
+plv8_cache_path(char *path, const char *name)
+{
+	snprintf(path, MAXPGPATH, "%s/%s", PLV8_CACHE_DIR, name);
+}
+
+static void
+plv8_cache_fill_header(plv8_cache_header *header, uint32 key, uint32 length)
+{
+	memset(header, 0, sizeof(plv8_cache_header));
+	header->magic = PLV8_CACHE_MAGIC;
+	header->key = key;
+	header->length = length;
+	strlcpy(header->v8_version, V8_VERSION_STRING, sizeof(header->v8_version));
+}
+
+/*
+ * Returns the palloc'ed content of the entry, or NULL if there is no
+ * usable one.
+ */
+char *
+plv8_cache_read(const char *name, uint32 key, int *length)
+{
+	char				path[MAXPGPATH];
+	plv8_cache_header	expected;
+	plv8_cache_header	header;
+	FILE			   *file;
+	char			   *data = NULL;
+	bool				stale = false;
+
+	plv8_cache_path(path, name);
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, file) == 1)
+	{
+		plv8_cache_fill_header(&expected, key, header.length);
+		if (memcmp(&header, &expected, sizeof(header)) == 0)
+		{
+			data = (char *) palloc(header.length);
+			if (fread(data, 1, header.length, file) != header.length)
+			{
+				pfree(data);
+				data = NULL;
+			}
+		}
+		else
+			stale = true;
+	}
+	FreeFile(file);
+
+	/*
+	 * An entry for an older version of the source or for another V8 is of no
+	 * use to anyone anymore.  A newer entry renamed into place meanwhile may
+	 * be removed with it, which only costs a miss.
+	 */
+	if (stale)
+		unlink(path);
+
+	if (data != NULL)
+		*length = header.length;
+	return data;
+}
+
+/*
+ * Failing to write the cache is not an error for the caller, so problems
+ * are only logged.
+ */
+void
+plv8_cache_write(const char *name, uint32 key, const char *data, int length)
+{
+	char				path[MAXPGPATH];
+	char				tmppath[MAXPGPATH];
+	plv8_cache_header	header;
+	FILE			   *file;
+	bool				ok;
+
+	if (mkdir(PLV8_CACHE_DIR, S_IRWXU) < 0 && errno != EEXIST)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", PLV8_CACHE_DIR)));
+		return;
+	}
+
+	plv8_cache_path(path, name);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp.%d", path, MyProcPid);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	plv8_cache_fill_header(&header, key, length);
+	ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(data, 1, length, file) == (size_t) length;
+	if (FreeFile(file) != 0)
+		ok = false;
+
+	if (!ok || rename(tmppath, path) < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+		unlink(tmppath);
+	}
+}
+
+/*
+ * V8 code cache for a function, named after its database and OID, and
+ * keyed by a hash of the source it was compiled from.
+ */
+static void
+plv8_code_cache_name(char *name, Oid fn_oid)
+{
+	snprintf(name, MAXPGPATH, "code_%u_%u", MyDatabaseId, fn_oid);
+}
+
+char *
+plv8_code_cache_read(Oid fn_oid, uint32 src_hash, int *length)
+{
+	char	name[MAXPGPATH];
+
+	plv8_code_cache_name(name, fn_oid);
+	return plv8_cache_read(name, src_hash, length);
+}
+
+void
+plv8_code_cache_write(Oid fn_oid, uint32 src_hash,
+					  const char *data, int length)
+{
+	char	name[MAXPGPATH];
+
+	plv8_code_cache_name(name, fn_oid);
+	plv8_cache_write(name, src_hash, data, length);
+}
+
+/*
+ * JavaScript translated from a CoffeeScript or LiveScript source, keyed by
+ * a hash of the source and by the compiler.  The entry holds the source in
+ * front of the result, so that sources with the same hash are told apart.
+ */
+static void
+plv8_dialect_cache_name(char *name, Dialect dialect, const char *src)
+{
+	uint32	hash = DatumGetUInt32(hash_any((const unsigned char *) src,
+										   strlen(src)));
+
+	snprintf(name, MAXPGPATH, "dialect_%d_%08x", (int) dialect, hash);
+}
+
+char *
+plv8_dialect_cache_read(Dialect dialect, uint32 compiler, const char *src)
+{
+	char	name[MAXPGPATH];
+	char   *data;
+	char   *result = NULL;
+	int		length;
+	size_t	srclen = strlen(src);
+
+	plv8_dialect_cache_name(name, dialect, src);
+	data = plv8_cache_read(name, compiler, &length);
+	if (data == NULL)
+		return NULL;
+
+	if ((size_t) length >= srclen + 2 && data[length - 1] == '\0' &&
+		memcmp(data, src, srclen + 1) == 0)
+		result = pstrdup(data + srclen + 1);
+	pfree(data);
+
+	return result;
+}
+
+void
+plv8_dialect_cache_write(Dialect dialect, uint32 compiler,
+						 const char *src, const char *js)
+{
+	char	name[MAXPGPATH];
+	size_t	srclen = strlen(src);
+	size_t	jslen = strlen(js);
+	char   *data = (char *) palloc(srclen + jslen + 2);
+
+	memcpy(data, src, srclen + 1);
+	memcpy(data + srclen + 1, js, jslen + 1);
+
+	plv8_dialect_cache_name(name, dialect, src);
+	plv8_cache_write(name, compiler, data, srclen + jslen + 2);
+	pfree(data);
+}
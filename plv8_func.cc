@@ -7,6 +7,7 @@
  */
 #include "plv8.h"
 #include "plv8_param.h"
+#include <memory>
 #include <string>
 
 extern "C" {
@@ -16,7 +17,33 @@ extern "C" {
 #include "parser/parse_type.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "nodes/memnodes.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+
+#if PG_VERSION_NUM >= 100000
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#else
+#include "access/heapam.h"
+#endif
+#include "access/sysattr.h"
+#include "catalog/namespace.h"
+#include "commands/copy.h"
+#include "executor/executor.h"
+#include "nodes/makefuncs.h"
+#include "parser/parse_relation.h"
+#include "tcop/utility.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/varlena.h"
+#endif
 } // extern "C"
 
 using namespace v8;
@@ -24,13 +51,26 @@ using namespace v8;
 static void plv8_FunctionInvoker(const FunctionCallbackInfo<v8::Value>& args) throw();
 static void plv8_Elog(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_Execute(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_ExecuteIter(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_ExecuteMany(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_Prepare(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_PlanCursor(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_PlanExecute(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_PlanExecuteBatch(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_PlanFree(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_CursorFetch(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_CursorMove(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_CursorClose(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_IteratorNext(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_IteratorReturn(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_IteratorClose(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_IteratorSelf(const FunctionCallbackInfo<v8::Value>& args);
+#if PG_VERSION_NUM >= 100000
+static void plv8_TransitionIterator(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_TransitionRows(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_TransitionColumns(const FunctionCallbackInfo<v8::Value>& args);
+static void plv8_CopyFrom(const FunctionCallbackInfo<v8::Value>& args);
+#endif
 static void plv8_ReturnNext(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_Subtransaction(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_FindFunction(const FunctionCallbackInfo<v8::Value>& args);
@@ -49,6 +89,73 @@ static void plv8_QuoteNullable(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_QuoteIdent(const FunctionCallbackInfo<v8::Value>& args);
 static void plv8_MemoryUsage(const FunctionCallbackInfo<v8::Value>& args);
 
+#define EXTERNAL_REFERENCE(func) reinterpret_cast<intptr_t>(func)
+
+/*
+ * Native functions reachable from the templates, which a V8 startup
+ * snapshot refers to by their index here.  Every callback registered with
+ * SetCallback must be listed, and the list is terminated by a zero.
+ */
+static const intptr_t external_references[] = {
+	EXTERNAL_REFERENCE(plv8_FunctionInvoker),
+	EXTERNAL_REFERENCE(plv8_Elog),
+	EXTERNAL_REFERENCE(plv8_Execute),
+	EXTERNAL_REFERENCE(plv8_ExecuteIter),
+	EXTERNAL_REFERENCE(plv8_ExecuteMany),
+	EXTERNAL_REFERENCE(plv8_Prepare),
+	EXTERNAL_REFERENCE(plv8_PlanCursor),
+	EXTERNAL_REFERENCE(plv8_PlanExecute),
+	EXTERNAL_REFERENCE(plv8_PlanExecuteBatch),
+	EXTERNAL_REFERENCE(plv8_PlanFree),
+	EXTERNAL_REFERENCE(plv8_CursorFetch),
+	EXTERNAL_REFERENCE(plv8_CursorMove),
+	EXTERNAL_REFERENCE(plv8_CursorClose),
+	EXTERNAL_REFERENCE(plv8_IteratorNext),
+	EXTERNAL_REFERENCE(plv8_IteratorReturn),
+	EXTERNAL_REFERENCE(plv8_IteratorClose),
+	EXTERNAL_REFERENCE(plv8_IteratorSelf),
+#if PG_VERSION_NUM >= 100000
+	EXTERNAL_REFERENCE(plv8_TransitionIterator),
+	EXTERNAL_REFERENCE(plv8_TransitionRows),
+	EXTERNAL_REFERENCE(plv8_TransitionColumns),
+	EXTERNAL_REFERENCE(plv8_CopyFrom),
+#endif
+	EXTERNAL_REFERENCE(plv8_ReturnNext),
+	EXTERNAL_REFERENCE(plv8_Subtransaction),
+	EXTERNAL_REFERENCE(plv8_FindFunction),
+	EXTERNAL_REFERENCE(plv8_GetWindowObject),
+	EXTERNAL_REFERENCE(plv8_WinGetPartitionLocal),
+	EXTERNAL_REFERENCE(plv8_WinSetPartitionLocal),
+	EXTERNAL_REFERENCE(plv8_WinGetCurrentPosition),
+	EXTERNAL_REFERENCE(plv8_WinGetPartitionRowCount),
+	EXTERNAL_REFERENCE(plv8_WinSetMarkPosition),
+	EXTERNAL_REFERENCE(plv8_WinRowsArePeers),
+	EXTERNAL_REFERENCE(plv8_WinGetFuncArgInPartition),
+	EXTERNAL_REFERENCE(plv8_WinGetFuncArgInFrame),
+	EXTERNAL_REFERENCE(plv8_WinGetFuncArgCurrent),
+	EXTERNAL_REFERENCE(plv8_QuoteLiteral),
+	EXTERNAL_REFERENCE(plv8_QuoteNullable),
+	EXTERNAL_REFERENCE(plv8_QuoteIdent),
+	EXTERNAL_REFERENCE(plv8_MemoryUsage),
+	0
+};
+
+/* Rows fetched at a time by the iterators of plv8.execute_iter() */
+#define PLV8_ITER_BATCH_SIZE	1000
+
+/* Internal fields of a ResultIterator */
+#define PLV8_ITER_CURSOR		0	/* portal name, or null once closed */
+#define PLV8_ITER_ROWS			1	/* converted rows of the current batch */
+#define PLV8_ITER_POS			2	/* next row in the batch */
+#define PLV8_ITER_CONV			3	/* Converter of the rows, kept across batches */
+#define PLV8_ITER_XACT			4	/* plv8_xact_count when opened */
+#define PLV8_ITER_MAX			5
+
+/* Internal fields of the other objects of templates, see GetTemplateLayout() */
+#define PLV8_PLAN_FIELDS		1	/* plv8_plan */
+#define PLV8_CURSOR_FIELDS		1	/* portal name */
+#define PLV8_WINDOW_FIELDS		1	/* fcinfo */
+
 /*
  * Window function API allows to store partition-local memory, but
  * the allocation is only once per partition.  maxlen represents
@@ -125,9 +232,55 @@ charToText(char *string)
 	return result;
 }
 
+/*
+ * Options of the SPI functions, given as an object after the parameters.
+ */
+typedef struct plv8_spi_options
+{
+	bool		columnar;		/* return an array per column */
+	bool		subtransaction;	/* run in a subtransaction of its own */
+} plv8_spi_options;
+
+static void
+GetSPIOptions(Handle<v8::Value> value, plv8_spi_options *options)
+{
+	Isolate			   *isolate = Isolate::GetCurrent();
+
+	memset(options, 0, sizeof(plv8_spi_options));
+	options->subtransaction = plv8_execute_subtransaction;
+	if (value.IsEmpty() || !value->IsObject() || value->IsArray())
+		return;
+
+	Local<v8::Object>	obj = Local<v8::Object>::Cast(value);
+	Local<v8::Value>	columnar = obj->Get(String::NewFromUtf8(isolate, "columnar", String::kInternalizedString));
+	Local<v8::Value>	subtransaction = obj->Get(String::NewFromUtf8(isolate, "subtransaction", String::kInternalizedString));
+
+	options->columnar = columnar->BooleanValue(isolate->GetCurrentContext()).ToChecked();
+	if (!subtransaction->IsUndefined())
+		options->subtransaction = subtransaction->BooleanValue(isolate->GetCurrentContext()).ToChecked();
+}
+
+/*
+ * Called in PG_CATCH() for a statement that failed outside of a
+ * subtransaction.  Keeps the error for DoCall and stops the call, see
+ * spi_pending_error.
+ */
+static void
+AbortCall(MemoryContext ctx)
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
+
+	MemoryContextSwitchTo(TopTransactionContext);
+	spi_pending_error = CopyErrorData();
+	FlushErrorState();
+	MemoryContextSwitchTo(ctx);
+
+	isolate->TerminateExecution();
+	throw js_error(spi_pending_error->message);
+}
 
 static Handle<v8::Value>
-SPIResultToValue(int status)
+SPIResultToValue(int status, bool columnar = false)
 {
 	Isolate* isolate = Isolate::GetCurrent();
 	Local<v8::Value>	result;
@@ -155,6 +308,13 @@ SPIResultToValue(int status)
 	{
 		int				nrows = SPI_processed;
 		Converter		conv(SPI_tuptable->tupdesc);
+
+		if (columnar)
+		{
+			result = conv.ToColumns(SPI_tuptable->vals, nrows);
+			break;
+		}
+
 		Local<Array>	rows = Array::New(isolate, nrows);
 
 		for (int r = 0; r < nrows; r++)
@@ -259,6 +419,11 @@ SetupPlv8Functions(Handle<ObjectTemplate> plv8)
 
 	SetCallback(plv8, "elog", plv8_Elog, attrFull);
 	SetCallback(plv8, "execute", plv8_Execute, attrFull);
+	SetCallback(plv8, "execute_iter", plv8_ExecuteIter, attrFull);
+	SetCallback(plv8, "execute_many", plv8_ExecuteMany, attrFull);
+#if PG_VERSION_NUM >= 100000
+	SetCallback(plv8, "copy_from", plv8_CopyFrom, attrFull);
+#endif
 	SetCallback(plv8, "prepare", plv8_Prepare, attrFull);
 	SetCallback(plv8, "return_next", plv8_ReturnNext, attrFull);
 	SetCallback(plv8, "subtransaction", plv8_Subtransaction, attrFull);
@@ -275,27 +440,42 @@ SetupPlv8Functions(Handle<ObjectTemplate> plv8)
 void
 SetupPrepFunctions(Handle<ObjectTemplate> templ)
 {
-	templ->SetInternalFieldCount(2);
+	templ->SetInternalFieldCount(PLV8_PLAN_FIELDS);
 	SetCallback(templ, "cursor", plv8_PlanCursor);
 	SetCallback(templ, "execute", plv8_PlanExecute);
+	SetCallback(templ, "execute_batch", plv8_PlanExecuteBatch);
 	SetCallback(templ, "free", plv8_PlanFree);
 }
 
 void
 SetupCursorFunctions(Handle<ObjectTemplate> templ)
 {
-	templ->SetInternalFieldCount(1);
+	templ->SetInternalFieldCount(PLV8_CURSOR_FIELDS);
 	SetCallback(templ, "fetch", plv8_CursorFetch);
 	SetCallback(templ, "move", plv8_CursorMove);
 	SetCallback(templ, "close", plv8_CursorClose);
 }
 
+void
+SetupIteratorFunctions(Handle<ObjectTemplate> templ)
+{
+	Isolate *isolate = Isolate::GetCurrent();
+
+	templ->SetInternalFieldCount(PLV8_ITER_MAX);
+	SetCallback(templ, "next", plv8_IteratorNext);
+	SetCallback(templ, "return", plv8_IteratorReturn);
+	SetCallback(templ, "close", plv8_IteratorClose);
+	templ->Set(Symbol::GetIterator(isolate),
+			   FunctionTemplate::New(isolate, plv8_FunctionInvoker,
+					WrapCallback(plv8_IteratorSelf)));
+}
+
 void
 SetupWindowFunctions(Handle<ObjectTemplate> templ)
 {
 	Isolate *isolate = Isolate::GetCurrent();
 	/* We store fcinfo here. */
-	templ->SetInternalFieldCount(1);
+	templ->SetInternalFieldCount(PLV8_WINDOW_FIELDS);
 
 	/* Functions. */
 	SetCallback(templ, "get_partition_local", plv8_WinGetPartitionLocal);
@@ -314,6 +494,33 @@ SetupWindowFunctions(Handle<ObjectTemplate> templ)
 	templ->Set(String::NewFromUtf8(isolate, "SEEK_TAIL", String::kInternalizedString), Int32::New(isolate, WINDOW_SEEK_TAIL));
 }
 
+const intptr_t *
+GetExternalReferences()
+{
+	return external_references;
+}
+
+/*
+ * The length of the list, which a snapshot refers to by index.
+ */
+int
+GetExternalReferenceCount()
+{
+	return (int) lengthof(external_references) - 1;
+}
+
+/*
+ * Describe the internal fields of the objects of the templates set up here,
+ * for the key of snapshots, which store the templates.
+ */
+void
+GetTemplateLayout(StringInfo buf)
+{
+	appendStringInfo(buf, "plv8:%d plan:%d cursor:%d iterator:%d window:%d",
+					 PLV8_INTNL_MAX, PLV8_PLAN_FIELDS, PLV8_CURSOR_FIELDS,
+					 PLV8_ITER_MAX, PLV8_WINDOW_FIELDS);
+}
+
 /*
  * v8 is not exception-safe! We cannot throw C++ exceptions over v8 functions.
  * So, we catch C++ exceptions and convert them to JavaScript ones.
@@ -464,7 +671,7 @@ plv8_Elog(const FunctionCallbackInfo<v8::Value>& args)
 }
 
 static Datum
-value_get_datum(Handle<v8::Value> value, Oid typid, char *isnull)
+value_get_datum(Handle<v8::Value> value, plv8_type *type, char *isnull)
 {
 	if (value->IsUndefined() || value->IsNull())
 	{
@@ -473,14 +680,12 @@ value_get_datum(Handle<v8::Value> value, Oid typid, char *isnull)
 	}
 	else
 	{
-		plv8_type	typinfo = { 0 };
 		bool		IsNull;
 		Datum		datum;
 
-		plv8_fill_type(&typinfo, typid);
 		try
 		{
-			datum = ToDatum(value, &IsNull, &typinfo);
+			datum = ToDatum(value, &IsNull, type);
 		}
 		catch (js_error& e){ e.rethrow(); }
 		catch (pg_error& e){ e.rethrow(); }
@@ -489,6 +694,183 @@ value_get_datum(Handle<v8::Value> value, Oid typid, char *isnull)
 	}
 }
 
+static Datum
+value_get_datum(Handle<v8::Value> value, Oid typid, char *isnull)
+{
+	if (value->IsUndefined() || value->IsNull())
+	{
+		*isnull = 'n';
+		return (Datum) 0;
+	}
+	else
+	{
+		plv8_type	typinfo = { 0 };
+
+		plv8_fill_type(&typinfo, typid);
+		return value_get_datum(value, &typinfo, isnull);
+	}
+}
+
+#if PG_VERSION_NUM >= 90000
+/*
+ * Saved plans of the statements run by plv8.execute() with parameters, by a
+ * hash of the SQL text.  The parameter types are deduced by the parser, so
+ * they are part of the plan, and the plan cache replans the statement when
+ * the objects it depends on change.  Beyond plv8.statement_cache_size, the
+ * least recently used statement that is not running is dropped.
+ */
+typedef struct plv8_statement
+{
+	uint32				hash;		/* hash key */
+	char			   *sql;
+	SPIPlanPtr			plan;
+	plv8_param_state   *parstate;	/* referenced by the plan on replanning */
+	int					running;	/* not to be dropped while above 0 */
+	uint64				last_used;
+} plv8_statement;
+
+static uint64 statement_clock = 0;
+
+static void
+plv8_free_statement(plv8_statement *stmt)
+{
+	SPI_freeplan(stmt->plan);
+	if (stmt->parstate->paramTypes)
+		pfree(stmt->parstate->paramTypes);
+	pfree(stmt->parstate);
+	pfree(stmt->sql);
+}
+
+/*
+ * Return the statement for sql from the cache of the current context,
+ * preparing and saving it first if needed, or NULL when it cannot be kept.
+ * The statement is marked running until plv8_unpin_statement().
+ */
+static plv8_statement *
+plv8_pin_statement(const char *sql)
+{
+	plv8_context	   *context;
+	plv8_statement	   *stmt;
+	plv8_param_state   *parstate;
+	SPIPlanPtr			plan;
+	uint32				hash;
+	bool				found;
+
+	if (plv8_statement_cache_size <= 0)
+		return NULL;
+
+	context = IsolateContext(Isolate::GetCurrent());
+	if (context->statements == NULL)
+	{
+		HASHCTL    hash_ctl = { 0 };
+
+		hash_ctl.keysize = sizeof(uint32);
+		hash_ctl.entrysize = sizeof(plv8_statement);
+		hash_ctl.hash = tag_hash;
+		context->statements = hash_create("PLv8 Statements", 64,
+								&hash_ctl, HASH_ELEM | HASH_FUNCTION);
+	}
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) sql, strlen(sql)));
+	stmt = (plv8_statement *)
+		hash_search(context->statements, &hash, HASH_FIND, NULL);
+	if (stmt != NULL)
+	{
+		if (strcmp(stmt->sql, sql) == 0)
+		{
+			context->statement_cache.hits++;
+			stmt->last_used = ++statement_clock;
+			stmt->running++;
+			return stmt;
+		}
+
+		/* a different statement with the same hash */
+		context->statement_cache.rejected++;
+		if (stmt->running > 0)
+			return NULL;
+		plv8_free_statement(stmt);
+		hash_search(context->statements, &hash, HASH_REMOVE, NULL);
+	}
+	else
+		context->statement_cache.misses++;
+
+	parstate = (plv8_param_state *)
+		MemoryContextAllocZero(TopMemoryContext, sizeof(plv8_param_state));
+	parstate->memcontext = TopMemoryContext;
+	PG_TRY();
+	{
+		plan = SPI_prepare_params(sql, plv8_variable_param_setup, parstate, 0);
+		SPI_keepplan(plan);
+	}
+	PG_CATCH();
+	{
+		if (parstate->paramTypes)
+			pfree(parstate->paramTypes);
+		pfree(parstate);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* evict before entering, so that the new entry stays */
+	while (hash_get_num_entries(context->statements) >= plv8_statement_cache_size)
+	{
+		HASH_SEQ_STATUS		status;
+		plv8_statement	   *oldest = NULL;
+
+		hash_seq_init(&status, context->statements);
+		while ((stmt = (plv8_statement *) hash_seq_search(&status)) != NULL)
+		{
+			if (stmt->running == 0 &&
+				(oldest == NULL || stmt->last_used < oldest->last_used))
+				oldest = stmt;
+		}
+		/* everything left is running, so go over the limit for now */
+		if (oldest == NULL)
+			break;
+		plv8_free_statement(oldest);
+		hash_search(context->statements, &oldest->hash, HASH_REMOVE, NULL);
+	}
+
+	stmt = (plv8_statement *)
+		hash_search(context->statements, &hash, HASH_ENTER, &found);
+	stmt->sql = MemoryContextStrdup(TopMemoryContext, sql);
+	stmt->plan = plan;
+	stmt->parstate = parstate;
+	stmt->running = 1;
+	stmt->last_used = ++statement_clock;
+
+	return stmt;
+}
+
+static void
+plv8_unpin_statement(plv8_statement *stmt)
+{
+	Assert(stmt->running > 0);
+	stmt->running--;
+}
+#endif	// PG_VERSION_NUM >= 90000
+
+/*
+ * Drop the statements of context.
+ */
+void
+plv8_release_statements(plv8_context *context)
+{
+#if PG_VERSION_NUM >= 90000
+	HASH_SEQ_STATUS		status;
+	plv8_statement	   *stmt;
+
+	if (context->statements == NULL)
+		return;
+
+	hash_seq_init(&status, context->statements);
+	while ((stmt = (plv8_statement *) hash_seq_search(&status)) != NULL)
+		plv8_free_statement(stmt);
+	hash_destroy(context->statements);
+	context->statements = NULL;
+#endif
+}
+
 static int
 plv8_execute_params(const char *sql, Handle<Array> params)
 {
@@ -504,23 +886,47 @@ plv8_execute_params(const char *sql, Handle<Array> params)
  */
 #if PG_VERSION_NUM >= 90000
 	SPIPlanPtr		plan;
-	plv8_param_state parstate = {0};
+	plv8_param_state local_parstate = {0};
+	plv8_param_state *parstate = &local_parstate;
+	plv8_statement *stmt = plv8_pin_statement(sql);
 	ParamListInfo	paramLI;
 
-	parstate.memcontext = CurrentMemoryContext;
-	plan = SPI_prepare_params(sql, plv8_variable_param_setup,
-							  &parstate, 0);
-	if (parstate.numParams != nparam)
-		elog(ERROR, "parameter numbers mismatch: %d != %d",
-				parstate.numParams, nparam);
-	for (int i = 0; i < nparam; i++)
+	if (stmt != NULL)
 	{
-		Handle<v8::Value>	param = params->Get(i);
-		values[i] = value_get_datum(param,
-								  parstate.paramTypes[i], &nulls[i]);
+		plan = stmt->plan;
+		parstate = stmt->parstate;
+	}
+	else
+	{
+		local_parstate.memcontext = CurrentMemoryContext;
+		plan = SPI_prepare_params(sql, plv8_variable_param_setup,
+								  &local_parstate, 0);
+	}
+
+	PG_TRY();
+	{
+		if (parstate->numParams != nparam)
+			elog(ERROR, "parameter numbers mismatch: %d != %d",
+					parstate->numParams, nparam);
+		for (int i = 0; i < nparam; i++)
+		{
+			Handle<v8::Value>	param = params->Get(i);
+			values[i] = value_get_datum(param,
+									  parstate->paramTypes[i], &nulls[i]);
+		}
+		paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
+		status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+	}
+	PG_CATCH();
+	{
+		if (stmt != NULL)
+			plv8_unpin_statement(stmt);
+		PG_RE_THROW();
 	}
-	paramLI = plv8_setup_variable_paramlist(&parstate, values, nulls);
-	status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+	PG_END_TRY();
+
+	if (stmt != NULL)
+		plv8_unpin_statement(stmt);
 #else
 	Oid			   *types = (Oid *) palloc(sizeof(Oid) * nparam);
 
@@ -556,31 +962,37 @@ convertArgsToArray(const FunctionCallbackInfo<v8::Value> &args, int start, int d
 }
 
 /*
- * plv8.execute(statement, [param, ...])
+ * Run sql in a subtransaction, or without one if subtransaction is false,
+ * and return its result as plv8.execute() does.
  */
-static void
-plv8_Execute(const FunctionCallbackInfo<v8::Value> &args)
+static Handle<v8::Value>
+ExecuteQuery(const char *sql, Handle<Array> params, bool columnar,
+			 bool subtransaction = true)
 {
 	int				status;
+	int				nparam = params.IsEmpty() ? 0 : params->Length();
 
-	if (args.Length() < 1) {
-		args.GetReturnValue().Set(Undefined(args.GetIsolate()));
-		return;
-	}
-
-	CString			sql(args[0]);
-	Handle<Array>	params;
+	EnsureSPIConnected();
 
-	if (args.Length() >= 2)
+	if (!subtransaction)
 	{
-		if (args[1]->IsArray())
-			params = Handle<Array>::Cast(args[1]);
-		else /* Consume trailing elements as an array. */
-			params = convertArgsToArray(args, 1, 1);
-	}
+		MemoryContext	ctx = CurrentMemoryContext;
 
-	int				nparam = params.IsEmpty() ? 0 : params->Length();
+		PG_TRY();
+		{
+			if (nparam == 0)
+				status = SPI_exec(sql, 0);
+			else
+				status = plv8_execute_params(sql, params);
+		}
+		PG_CATCH();
+		{
+			AbortCall(ctx);
+		}
+		PG_END_TRY();
 
+		return SPIResultToValue(status, columnar);
+	}
 
 	SubTranBlock	subtran;
 	PG_TRY();
@@ -601,105 +1013,1324 @@ plv8_Execute(const FunctionCallbackInfo<v8::Value> &args)
 
 	subtran.exit(true);
 
-	args.GetReturnValue().Set(SPIResultToValue(status));
+	return SPIResultToValue(status, columnar);
 }
 
 /*
- * plv8.prepare(statement, args...)
+ * Run plan once for each row of parameters, all in one subtransaction
+ * unless options say otherwise.  rows is an array of parameter arrays, or an
+ * object of columns, arrays or typed arrays of one parameter each, as the
+ * columnar mode returns them.  Returns the sum of the processed rows, or
+ * the rows returned by all of the runs in one array.  The parameter types
+ * are looked up once for all of the rows unless argtypes gives them.
  */
-static void
-plv8_Prepare(const FunctionCallbackInfo<v8::Value> &args)
+static Handle<v8::Value>
+ExecuteBatch(SPIPlanPtr plan, plv8_param_state *parstate,
+			 Handle<v8::Value> rows, plv8_spi_options *options,
+			 plv8_type *argtypes)
 {
-	Isolate *		isolate = args.GetIsolate();
-	SPIPlanPtr		initial = NULL, saved;
-	CString			sql(args[0]);
-	Handle<Array>	array;
-	int				arraylen = 0;
-	Oid			   *types = NULL;
-	plv8_param_state *parstate = NULL;
+	Isolate			   *isolate = Isolate::GetCurrent();
+	Local<Context>		context = isolate->GetCurrentContext();
+	Local<Array>		batch;
+	std::vector< Local<v8::Object> > columns;
+	int					nrows = 0;
+	int					nparam;
+	plv8_type		   *types = argtypes;
+	Datum			   *values;
+	char			   *nulls;
+	MemoryContext		ctx = CurrentMemoryContext;
+	MemoryContext		rowcontext;
+	SubTranBlock		subtran;
+	std::unique_ptr<Converter> conv;
+	Local<Array>		result;
+	int					nresults = 0;
+	double				processed = 0;
 
-	if (args.Length() > 1)
+	if (parstate)
+		nparam = parstate->numParams;
+	else
+		nparam = SPI_getargcount(plan);
+
+	if (rows->IsArray())
 	{
-		if (args[1]->IsArray())
-			array = Handle<Array>::Cast(args[1]);
-		else /* Consume trailing elements as an array. */
-			array = convertArgsToArray(args, 1, 0);
-		arraylen = array->Length();
-		types = (Oid *) palloc(sizeof(Oid) * arraylen);
+		batch = Local<Array>::Cast(rows);
+		nrows = batch->Length();
 	}
-
-	for (int i = 0; i < arraylen; i++)
+	else if (rows->IsObject())
 	{
-		CString			typestr(array->Get(i));
-		int32			typemod;
+		Local<v8::Object>	obj = Local<v8::Object>::Cast(rows);
+		Local<Array>		names = obj->GetOwnPropertyNames(context).ToLocalChecked();
 
-#if PG_VERSION_NUM >= 90400
-		parseTypeString(typestr, &types[i], &typemod, false);
-#else
-		parseTypeString(typestr, &types[i], &typemod);
-#endif
+		for (uint32 i = 0; i < names->Length(); i++)
+		{
+			Local<v8::Value>	column = obj->Get(names->Get(i));
+			int					length;
+
+			if (column->IsArray())
+				length = Local<Array>::Cast(column)->Length();
+			else if (column->IsTypedArray())
+				length = Local<TypedArray>::Cast(column)->Length();
+			else
+				throw js_error("columns must be arrays or typed arrays");
+			if (i > 0 && length != nrows)
+				throw js_error("columns must be of the same length");
+			nrows = length;
+			columns.push_back(Local<v8::Object>::Cast(column));
+		}
+		if ((int) columns.size() != nparam)
+		{
+			StringInfoData	buf;
+
+			initStringInfo(&buf);
+			appendStringInfo(&buf,
+					"plan expected %d argument(s), given is %d",
+					nparam, (int) columns.size());
+			throw js_error(pstrdup(buf.data));
+		}
 	}
+	else
+		throw js_error("rows must be an array or an object of columns");
 
-	PG_TRY();
+	values = (Datum *) palloc(sizeof(Datum) * Max(nparam, 1));
+	nulls = (char *) palloc(sizeof(char) * Max(nparam, 1));
+	if (types == NULL)
 	{
-#if PG_VERSION_NUM >= 90000
-		if (args.Length() == 1)
+		types = (plv8_type *) palloc0(sizeof(plv8_type) * Max(nparam, 1));
+		PG_TRY();
 		{
-			parstate =
-				(plv8_param_state *) palloc0(sizeof(plv8_param_state));
-			parstate->memcontext = CurrentMemoryContext;
-			initial = SPI_prepare_params(sql, plv8_variable_param_setup,
-										 parstate, 0);
+			for (int i = 0; i < nparam; i++)
+			{
+				Oid		typid;
+
+				if (parstate)
+					typid = parstate->paramTypes[i];
+				else
+					typid = SPI_getargtypeid(plan, i);
+				plv8_fill_type(&types[i], typid);
+			}
 		}
-		else
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+
+	/* the parameters of each row are freed before the next one */
+#if PG_VERSION_NUM < 110000
+	rowcontext = AllocSetContextCreate(ctx,
+									   "PLv8 Batch Row Context",
+									   ALLOCSET_SMALL_MINSIZE,
+									   ALLOCSET_SMALL_INITSIZE,
+									   ALLOCSET_SMALL_MAXSIZE);
+#else
+	rowcontext = AllocSetContextCreate(ctx,
+									   "PLv8 Batch Row Context",
+									   ALLOCSET_SMALL_SIZES);
 #endif
-			initial = SPI_prepare(sql, arraylen, types);
-		saved = SPI_saveplan(initial);
-		SPI_freeplan(initial);
+
+	PG_TRY();
+	{
+		if (options->subtransaction)
+			subtran.enter();
 	}
 	PG_CATCH();
 	{
+		MemoryContextDelete(rowcontext);
 		throw pg_error();
 	}
 	PG_END_TRY();
 
-	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->plan_template);
-
-	Local<v8::Object> result = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
-	result->SetInternalField(0, External::New(isolate, saved));
-	result->SetInternalField(1, External::New(isolate, parstate));
-
-	args.GetReturnValue().Set(result);
-}
+	try
+	{
+		for (int r = 0; r < nrows; r++)
+		{
+			Local<v8::Object>	row;
+			int					status;
+
+			if (columns.empty())
+			{
+				Local<v8::Value>	value = batch->Get(r);
+
+				if (!value->IsArray() ||
+					(int) Local<Array>::Cast(value)->Length() != nparam)
+				{
+					StringInfoData	buf;
+
+					initStringInfo(&buf);
+					appendStringInfo(&buf,
+							"plan expected %d argument(s) in row %d", nparam, r);
+					throw js_error(pstrdup(buf.data));
+				}
+				row = Local<v8::Object>::Cast(value);
+			}
 
-/*
- * plan.cursor(args, ...)
- */
-static void
-plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
+			PG_TRY();
+			{
+				MemoryContextReset(rowcontext);
+				MemoryContextSwitchTo(rowcontext);
+				for (int i = 0; i < nparam; i++)
+				{
+					Handle<v8::Value>	param =
+						columns.empty() ? row->Get(i) : columns[i]->Get(r);
+
+					values[i] = value_get_datum(param, &types[i], &nulls[i]);
+				}
+#if PG_VERSION_NUM >= 90000
+				if (parstate)
+				{
+					ParamListInfo	paramLI;
+
+					paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
+					status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+				}
+				else
+#endif
+					status = SPI_execute_plan(plan, values, nulls, false, 0);
+				MemoryContextSwitchTo(ctx);
+			}
+			PG_CATCH();
+			{
+				MemoryContextSwitchTo(ctx);
+				if (!options->subtransaction)
+					AbortCall(ctx);
+				throw pg_error();
+			}
+			PG_END_TRY();
+
+			if (status < 0)
+				throw js_error(FormatSPIStatus(status));
+
+			if (SPI_tuptable != NULL)
+			{
+				if (!conv)
+				{
+					conv.reset(new Converter(SPI_tuptable->tupdesc, ctx));
+					result = Array::New(isolate);
+				}
+				for (uint64 t = 0; t < SPI_processed; t++)
+					result->Set(nresults++, conv->ToValue(SPI_tuptable->vals[t]));
+				SPI_freetuptable(SPI_tuptable);
+			}
+			processed += SPI_processed;
+		}
+	}
+	catch (js_error& e)
+	{
+		if (options->subtransaction)
+			subtran.exit(false);
+		MemoryContextDelete(rowcontext);
+		throw;
+	}
+	catch (pg_error& e)
+	{
+		/* also raised by the Converter, outside of the PG_TRY above */
+		if (options->subtransaction)
+			subtran.exit(false);
+		MemoryContextDelete(rowcontext);
+		throw;
+	}
+
+	if (options->subtransaction)
+		subtran.exit(true);
+	MemoryContextDelete(rowcontext);
+	if (argtypes == NULL)
+		pfree(types);
+	pfree(values);
+	pfree(nulls);
+
+	if (conv)
+		return result;
+	return Number::New(isolate, processed);
+}
+
+/*
+ * plv8.execute(statement, [param, ...])
+ * plv8.execute(statement, [param, ...], options)
+ */
+static void
+plv8_Execute(const FunctionCallbackInfo<v8::Value> &args)
+{
+	plv8_spi_options options;
+
+	if (args.Length() < 1) {
+		args.GetReturnValue().Set(Undefined(args.GetIsolate()));
+		return;
+	}
+
+	CString			sql(args[0]);
+	Handle<Array>	params;
+
+	GetSPIOptions(Handle<v8::Value>(), &options);
+	if (args.Length() >= 2)
+	{
+		if (args[1]->IsArray())
+		{
+			params = Handle<Array>::Cast(args[1]);
+			if (args.Length() >= 3)
+				GetSPIOptions(args[2], &options);
+		}
+		else /* Consume trailing elements as an array. */
+			params = convertArgsToArray(args, 1, 1);
+	}
+
+	args.GetReturnValue().Set(ExecuteQuery(sql, params, options.columnar,
+										   options.subtransaction));
+}
+
+/*
+ * plv8.execute_many(statement, rows)
+ * plv8.execute_many(statement, rows, options)
+ */
+static void
+plv8_ExecuteMany(const FunctionCallbackInfo<v8::Value> &args)
+{
+	plv8_spi_options options;
+
+	if (args.Length() < 2)
+		throw js_error("usage: plv8.execute_many(sql, rows[, options])");
+
+	CString			sql(args[0]);
+	Handle<v8::Value> result;
+
+	GetSPIOptions(args.Length() >= 3 ? args[2] : Handle<v8::Value>(), &options);
+	EnsureSPIConnected();
+
+#if PG_VERSION_NUM >= 90000
+	plv8_statement	   *stmt = NULL;
+	plv8_param_state   *parstate;
+	SPIPlanPtr			plan;
+
+	/* the statement cache keeps the plan, which is made here otherwise */
+	PG_TRY();
+	{
+		stmt = plv8_pin_statement(sql);
+		if (stmt != NULL)
+		{
+			plan = stmt->plan;
+			parstate = stmt->parstate;
+		}
+		else
+		{
+			parstate = (plv8_param_state *) palloc0(sizeof(plv8_param_state));
+			parstate->memcontext = CurrentMemoryContext;
+			plan = SPI_prepare_params(sql, plv8_variable_param_setup,
+									  parstate, 0);
+		}
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	try
+	{
+		result = ExecuteBatch(plan, parstate, args[1], &options, NULL);
+	}
+	catch (...)
+	{
+		if (stmt != NULL)
+			plv8_unpin_statement(stmt);
+		throw;
+	}
+	if (stmt != NULL)
+		plv8_unpin_statement(stmt);
+#else
+	throw js_error("plv8.execute_many() requires PostgreSQL 9.0 or later");
+#endif
+
+	args.GetReturnValue().Set(result);
+}
+
+/*
+ * Open a cursor for sql, as plv8_execute_params runs it.
+ */
+static Portal
+plv8_cursor_open_params(const char *sql, Handle<Array> params)
+{
+	Portal			cursor;
+	int				nparam = params.IsEmpty() ? 0 : params->Length();
+	Datum		   *values = NULL;
+	char		   *nulls = NULL;
+
+	if (nparam > 0)
+	{
+		values = (Datum *) palloc(sizeof(Datum) * nparam);
+		nulls = (char *) palloc(sizeof(char) * nparam);
+	}
+#if PG_VERSION_NUM >= 90000
+	SPIPlanPtr		plan;
+	plv8_param_state local_parstate = {0};
+	plv8_param_state *parstate = &local_parstate;
+	plv8_statement *stmt = plv8_pin_statement(sql);
+	ParamListInfo	paramLI;
+
+	if (stmt != NULL)
+	{
+		plan = stmt->plan;
+		parstate = stmt->parstate;
+	}
+	else
+	{
+		local_parstate.memcontext = CurrentMemoryContext;
+		plan = SPI_prepare_params(sql, plv8_variable_param_setup,
+								  &local_parstate, 0);
+	}
+
+	PG_TRY();
+	{
+		if (parstate->numParams != nparam)
+			elog(ERROR, "parameter numbers mismatch: %d != %d",
+					parstate->numParams, nparam);
+		for (int i = 0; i < nparam; i++)
+		{
+			Handle<v8::Value>	param = params->Get(i);
+			values[i] = value_get_datum(param,
+									  parstate->paramTypes[i], &nulls[i]);
+		}
+		paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
+		/* the portal keeps its own reference to the plan */
+		cursor = SPI_cursor_open_with_paramlist(NULL, plan, paramLI, false);
+	}
+	PG_CATCH();
+	{
+		if (stmt != NULL)
+			plv8_unpin_statement(stmt);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (stmt != NULL)
+		plv8_unpin_statement(stmt);
+	else
+		SPI_freeplan(plan);
+#else
+	Oid			   *types = (Oid *) palloc(sizeof(Oid) * Max(nparam, 1));
+
+	for (int i = 0; i < nparam; i++)
+	{
+		Handle<v8::Value>	param = params->Get(i);
+
+		types[i] = inferred_datum_type(param);
+		if (types[i] == InvalidOid)
+			elog(ERROR, "parameter[%d] cannot translate to a database type", i);
+
+		values[i] = value_get_datum(param, types[i], &nulls[i]);
+	}
+	cursor = SPI_cursor_open_with_args(NULL, sql, nparam, types, values, nulls,
+									   false, 0);
+
+	pfree(types);
+#endif
+
+	return cursor;
+}
+
+/*
+ * Open an iterator over the rows of sql, see plv8.execute_iter().
+ */
+static Local<v8::Object>
+OpenResultIterator(const char *sql, Handle<Array> params)
+{
+	Isolate *		isolate = Isolate::GetCurrent();
+	Portal			cursor;
+	Converter	   *conv = NULL;
+
+	EnsureSPIConnected();
+
+	PG_TRY();
+	{
+		cursor = plv8_cursor_open_params(sql, params);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	/* one Converter for every batch, so the rows share their constructor */
+	if (cursor->tupDesc != NULL)
+		conv = NewTransactionConverter(cursor->tupDesc);
+
+	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->iterator_template);
+
+	Local<v8::Object> result = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
+	result->SetInternalField(PLV8_ITER_CURSOR, ToString(cursor->name, strlen(cursor->name)));
+	result->SetInternalField(PLV8_ITER_ROWS, Undefined(isolate));
+	result->SetInternalField(PLV8_ITER_POS, Int32::New(isolate, 0));
+	result->SetInternalField(PLV8_ITER_CONV, External::New(isolate, conv));
+	result->SetInternalField(PLV8_ITER_XACT, Number::New(isolate, plv8_xact_count));
+
+	return result;
+}
+
+/*
+ * plv8.execute_iter(statement, [param, ...])
+ *
+ * Returns an iterator over the rows of a query, which fetches and converts
+ * them PLV8_ITER_BATCH_SIZE at a time through a cursor.
+ */
+static void
+plv8_ExecuteIter(const FunctionCallbackInfo<v8::Value> &args)
+{
+	Isolate *		isolate = args.GetIsolate();
+
+	if (args.Length() < 1) {
+		args.GetReturnValue().Set(Undefined(isolate));
+		return;
+	}
+
+	CString			sql(args[0]);
+	Handle<Array>	params;
+
+	if (args.Length() >= 2)
+	{
+		if (args[1]->IsArray())
+			params = Handle<Array>::Cast(args[1]);
+		else /* Consume trailing elements as an array. */
+			params = convertArgsToArray(args, 1, 1);
+	}
+
+	args.GetReturnValue().Set(OpenResultIterator(sql, params));
+}
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * The query that reads the transition table of this.
+ */
+static char *
+TransitionTableQuery(Handle<v8::Object> self)
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
+	CString			name(self->Get(String::NewFromUtf8(isolate, "name", String::kInternalizedString)));
+	char		   *sql;
+
+	if (name.str() == NULL)
+		throw js_error("transition table has no name");
+
+	PG_TRY();
+	{
+		sql = psprintf("SELECT * FROM %s", quote_identifier(name));
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	return sql;
+}
+
+/*
+ * table[Symbol.iterator]()
+ */
+static void
+plv8_TransitionIterator(const FunctionCallbackInfo<v8::Value> &args)
+{
+	char   *sql = TransitionTableQuery(args.This());
+
+	args.GetReturnValue().Set(OpenResultIterator(sql, Handle<Array>()));
+	pfree(sql);
+}
+
+/*
+ * table.rows()
+ */
+static void
+plv8_TransitionRows(const FunctionCallbackInfo<v8::Value> &args)
+{
+	char   *sql = TransitionTableQuery(args.This());
+
+	args.GetReturnValue().Set(ExecuteQuery(sql, Handle<Array>(), false));
+	pfree(sql);
+}
+
+/*
+ * table.columns()
+ */
+static void
+plv8_TransitionColumns(const FunctionCallbackInfo<v8::Value> &args)
+{
+	char   *sql = TransitionTableQuery(args.This());
+
+	args.GetReturnValue().Set(ExecuteQuery(sql, Handle<Array>(), true));
+	pfree(sql);
+}
+
+/*
+ * The NEW or OLD argument of a trigger with a transition table, which is
+ * read through SPI under its name on demand, so that no row is converted
+ * unless the function asks for it.
+ */
+Local<v8::Object>
+CreateTransitionTable(const char *name)
+{
+	Isolate		   *isolate = Isolate::GetCurrent();
+	Local<Context>	context = isolate->GetCurrentContext();
+	Local<v8::Object> table = v8::Object::New(isolate);
+
+	table->DefineOwnProperty(context,
+		String::NewFromUtf8(isolate, "name", String::kInternalizedString),
+		ToString(name), ReadOnly).ToChecked();
+	table->Set(String::NewFromUtf8(isolate, "rows", String::kInternalizedString),
+		Function::New(context, plv8_FunctionInvoker,
+			WrapCallback(plv8_TransitionRows)).ToLocalChecked());
+	table->Set(String::NewFromUtf8(isolate, "columns", String::kInternalizedString),
+		Function::New(context, plv8_FunctionInvoker,
+			WrapCallback(plv8_TransitionColumns)).ToLocalChecked());
+	table->Set(Symbol::GetIterator(isolate),
+		Function::New(context, plv8_FunctionInvoker,
+			WrapCallback(plv8_TransitionIterator)).ToLocalChecked());
+
+	return table;
+}
+
+/*
+ * State of plv8.copy_from().  The data source callback of COPY takes no
+ * argument, so it is found in copy_state.  Rows are written out in the text
+ * format of COPY a chunk at a time, as COPY reads them.
+ */
+typedef struct plv8_copy_state
+{
+	Local<Array>		rows;		/* an array of arrays or objects, */
+	Local<v8::Object>	iterator;	/* an iterator of them, */
+	Local<Function>		next;
+	Local<v8::Object>	columnobj;	/* or an object of columns */
+	std::vector< Local<v8::Object> > columns;
+	std::vector< Local<v8::String> > names;
+	int					nrows;
+	int					pos;
+	bool				done;
+	int					natts;
+	char			  **attnames;
+	plv8_type		   *types;
+	FmgrInfo		   *outfuncs;
+	MemoryContext		rowcontext;	/* reset for each chunk */
+	StringInfoData		buf;		/* the chunk, read up to bufpos */
+	int					bufpos;
+} plv8_copy_state;
+
+static plv8_copy_state *copy_state = NULL;
+
+static void
+CopyAppendEscaped(StringInfo buf, const char *str)
+{
+	for (const char *p = str; *p; p++)
+	{
+		switch (*p)
+		{
+			case '\\':
+				appendBinaryStringInfo(buf, "\\\\", 2);
+				break;
+			case '\n':
+				appendBinaryStringInfo(buf, "\\n", 2);
+				break;
+			case '\r':
+				appendBinaryStringInfo(buf, "\\r", 2);
+				break;
+			case '\t':
+				appendBinaryStringInfo(buf, "\\t", 2);
+				break;
+			default:
+				appendStringInfoCharMacro(buf, *p);
+				break;
+		}
+	}
+}
+
+/*
+ * Look up the names and the columns of the rows once COPY has opened the
+ * table.  Called outside of the handle scope of CopyNextRow so that they
+ * last for the whole call.
+ */
+static void
+CopyResolveColumns(plv8_copy_state *state)
+{
+	for (int i = 0; i < state->natts; i++)
+		state->names.push_back(ToInternalizedString(state->attnames[i]));
+
+	if (state->columnobj.IsEmpty())
+		return;
+
+	for (int i = 0; i < state->natts; i++)
+	{
+		Local<v8::Value>	column = state->columnobj->Get(state->names[i]);
+		int					length;
+
+		if (column->IsArray())
+			length = Local<Array>::Cast(column)->Length();
+		else if (column->IsTypedArray())
+			length = Local<TypedArray>::Cast(column)->Length();
+		else
+		{
+			StringInfoData	buf;
+
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "column \"%s\" must be an array or a typed array",
+							 state->attnames[i]);
+			throw js_error(pstrdup(buf.data));
+		}
+		if (i > 0 && length != state->nrows)
+			throw js_error("columns must be of the same length");
+		state->nrows = length;
+		state->columns.push_back(Local<v8::Object>::Cast(column));
+	}
+}
+
+/*
+ * Append the next row to the chunk, or return false after the last one.
+ */
+static bool
+CopyNextRow(plv8_copy_state *state)
+{
+	Isolate			   *isolate = Isolate::GetCurrent();
+	HandleScope			handle_scope(isolate);
+	Local<Context>		context = isolate->GetCurrentContext();
+	Local<v8::Value>	row;
+
+	if (state->done)
+		return false;
+
+	if (!state->next.IsEmpty())
+	{
+		TryCatch			try_catch(isolate);
+		Local<v8::Value>	result;
+
+		if (!state->next->Call(context, state->iterator, 0, NULL).ToLocal(&result))
+			throw js_error(try_catch);
+		if (!result->IsObject())
+			throw js_error("iterator returned a non-object");
+
+		Local<v8::Object>	obj = Local<v8::Object>::Cast(result);
+
+		if (obj->Get(String::NewFromUtf8(isolate, "done", String::kInternalizedString))
+				->BooleanValue(context).FromMaybe(true))
+		{
+			state->done = true;
+			return false;
+		}
+		row = obj->Get(String::NewFromUtf8(isolate, "value", String::kInternalizedString));
+	}
+	else if (state->pos >= state->nrows)
+	{
+		state->done = true;
+		return false;
+	}
+	else if (state->columns.empty())
+		row = state->rows->Get(state->pos);
+
+	if (state->columns.empty())
+	{
+		if (row->IsArray())
+		{
+			int		length = Local<Array>::Cast(row)->Length();
+
+			if (length != state->natts)
+			{
+				StringInfoData	buf;
+
+				initStringInfo(&buf);
+				appendStringInfo(&buf, "row %d has %d values, expected %d",
+								 state->pos, length, state->natts);
+				throw js_error(pstrdup(buf.data));
+			}
+		}
+		else if (!row->IsObject())
+			throw js_error("rows must be arrays or objects");
+	}
+
+	for (int i = 0; i < state->natts; i++)
+	{
+		Local<v8::Value>	value;
+
+		if (!state->columns.empty())
+			value = state->columns[i]->Get(state->pos);
+		else if (row->IsArray())
+			value = Local<Array>::Cast(row)->Get(i);
+		else
+			value = Local<v8::Object>::Cast(row)->Get(state->names[i]);
+
+		if (i > 0)
+			appendStringInfoCharMacro(&state->buf, '\t');
+
+		if (value->IsUndefined() || value->IsNull())
+			appendBinaryStringInfo(&state->buf, "\\N", 2);
+		else if (value->IsString())
+		{
+			CString		str(value);
+
+			CopyAppendEscaped(&state->buf, str);
+		}
+		else
+		{
+			bool		isnull;
+			Datum		datum = ToDatum(value, &isnull, &state->types[i]);
+
+			if (isnull)
+				appendBinaryStringInfo(&state->buf, "\\N", 2);
+			else
+			{
+				PG_TRY();
+				{
+					CopyAppendEscaped(&state->buf,
+						OutputFunctionCall(&state->outfuncs[i], datum));
+				}
+				PG_CATCH();
+				{
+					throw pg_error();
+				}
+				PG_END_TRY();
+			}
+		}
+	}
+	appendStringInfoCharMacro(&state->buf, '\n');
+	state->pos++;
+
+	return true;
+}
+
+/*
+ * The data source callback of COPY.
+ */
+static int
+plv8_copy_read_data(void *outbuf, int minread, int maxread)
+{
+	plv8_copy_state	   *state = copy_state;
+	int					nread;
+
+	if (state->bufpos >= state->buf.len)
+	{
+		MemoryContext	oldcontext;
+
+		resetStringInfo(&state->buf);
+		state->bufpos = 0;
+		MemoryContextReset(state->rowcontext);
+		oldcontext = MemoryContextSwitchTo(state->rowcontext);
+		try
+		{
+			if (state->names.empty() && state->natts > 0)
+				CopyResolveColumns(state);
+			while (state->buf.len < maxread && CopyNextRow(state))
+				;
+		}
+		catch (js_error& e) { e.rethrow(); }
+		catch (pg_error& e) { e.rethrow(); }
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	nread = Min(maxread, state->buf.len - state->bufpos);
+	memcpy(outbuf, state->buf.data + state->bufpos, nread);
+	state->bufpos += nread;
+
+	return nread;
+}
+
+/*
+ * Open table, check that the user may COPY into its columns, and run COPY
+ * FROM with the rows of state.  attnamelist is NIL for all columns.
+ */
+static uint64
+plv8_copy_from(const char *table, List *attnamelist, plv8_copy_state *state)
+{
+	ParseState	   *pstate = make_parsestate(NULL);
+	RangeVar	   *rv = makeRangeVarFromNameList(stringToQualifiedNameList(table));
+	Relation		rel;
+	RangeTblEntry  *rte;
+	TupleDesc		tupdesc;
+	List		   *attnums = NIL;
+	List		   *options;
+	ListCell	   *lc;
+	CopyState		cstate;
+	uint64			processed;
+	int				i;
+
+#if PG_VERSION_NUM >= 120000
+	rel = table_openrv(rv, RowExclusiveLock);
+#else
+	rel = heap_openrv(rv, RowExclusiveLock);
+#endif
+#if PG_VERSION_NUM >= 130000
+	rte = addRangeTableEntryForRelation(pstate, rel, RowExclusiveLock,
+										NULL, false, false)->p_rte;
+#elif PG_VERSION_NUM >= 120000
+	rte = addRangeTableEntryForRelation(pstate, rel, RowExclusiveLock,
+										NULL, false, false);
+#else
+	rte = addRangeTableEntryForRelation(pstate, rel, NULL, false, false);
+#endif
+	rte->requiredPerms = ACL_INSERT;
+
+	tupdesc = RelationGetDescr(rel);
+	if (attnamelist == NIL)
+	{
+		for (i = 0; i < tupdesc->natts; i++)
+		{
+			Form_pg_attribute	attr = TupleDescAttr(tupdesc, i);
+
+			if (attr->attisdropped)
+				continue;
+#if PG_VERSION_NUM >= 120000
+			if (attr->attgenerated)
+				continue;
+#endif
+			attnums = lappend_int(attnums, attr->attnum);
+		}
+	}
+	else
+	{
+		foreach(lc, attnamelist)
+		{
+			char	   *name = strVal(lfirst(lc));
+			AttrNumber	attnum = attnameAttNum(rel, name, false);
+
+			if (attnum == InvalidAttrNumber)
+				ereport(ERROR,
+						(errcode(ERRCODE_UNDEFINED_COLUMN),
+						 errmsg("column \"%s\" of relation \"%s\" does not exist",
+								name, RelationGetRelationName(rel))));
+			attnums = lappend_int(attnums, attnum);
+		}
+	}
+
+	/* the same checks as DoCopy */
+	foreach(lc, attnums)
+		rte->insertedCols = bms_add_member(rte->insertedCols,
+							lfirst_int(lc) - FirstLowInvalidHeapAttributeNumber);
+	ExecCheckRTPerms(pstate->p_rtable, true);
+
+	if (check_enable_rls(RelationGetRelid(rel), InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("COPY FROM not supported with row-level security"),
+				 errhint("Use INSERT statements instead.")));
+
+	if (XactReadOnly && !rel->rd_islocaltemp)
+		PreventCommandIfReadOnly("COPY FROM");
+	PreventCommandIfParallelMode("COPY FROM");
+
+	/* values other than strings are written out by the column's type */
+	state->natts = list_length(attnums);
+	state->attnames = (char **) palloc(sizeof(char *) * Max(state->natts, 1));
+	state->types = (plv8_type *) palloc(sizeof(plv8_type) * Max(state->natts, 1));
+	state->outfuncs = (FmgrInfo *) palloc(sizeof(FmgrInfo) * Max(state->natts, 1));
+	i = 0;
+	foreach(lc, attnums)
+	{
+		Form_pg_attribute	attr = TupleDescAttr(tupdesc, lfirst_int(lc) - 1);
+		Oid					outfunc;
+		bool				isvarlena;
+
+		state->attnames[i] = pstrdup(NameStr(attr->attname));
+		plv8_fill_type(&state->types[i], attr->atttypid);
+		getTypeOutputInfo(attr->atttypid, &outfunc, &isvarlena);
+		fmgr_info(outfunc, &state->outfuncs[i]);
+		i++;
+	}
+
+	/* CString gives the rows in the database encoding */
+	options = list_make1(makeDefElem((char *) "encoding",
+			(Node *) makeString(pstrdup(GetDatabaseEncodingName())), -1));
+
+	CommandCounterIncrement();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	cstate = BeginCopyFrom(pstate, rel, NULL, false, plv8_copy_read_data,
+						   attnamelist, options);
+	processed = CopyFrom(cstate);
+	EndCopyFrom(cstate);
+	PopActiveSnapshot();
+
+#if PG_VERSION_NUM >= 120000
+	table_close(rel, NoLock);
+#else
+	heap_close(rel, NoLock);
+#endif
+	free_parsestate(pstate);
+
+	return processed;
+}
+
+/*
+ * plv8.copy_from(table, columns, rows)
+ * plv8.copy_from(table, columns, rows, options)
+ *
+ * Loads rows into table through COPY FROM, which inserts them in batches
+ * and runs the triggers and index updates of the table as COPY does.
+ */
+static void
+plv8_CopyFrom(const FunctionCallbackInfo<v8::Value> &args)
+{
+	Isolate			   *isolate = args.GetIsolate();
+	Local<Context>		context = isolate->GetCurrentContext();
+	plv8_spi_options	options;
+	plv8_copy_state		state;
+	plv8_copy_state	   *prev_state = copy_state;
+	MemoryContext		ctx = CurrentMemoryContext;
+	SubTranBlock		subtran;
+	List			   *attnamelist = NIL;
+	uint64				processed;
+
+	if (args.Length() < 3)
+		throw js_error("usage: plv8.copy_from(table, columns, rows[, options])");
+
+	CString				table(args[0]);
+	Local<v8::Value>	rows = args[2];
+
+	GetSPIOptions(args.Length() >= 4 ? args[3] : Handle<v8::Value>(), &options);
+
+	if (args[1]->IsArray())
+	{
+		Local<Array>	names = Local<Array>::Cast(args[1]);
+
+		for (uint32 i = 0; i < names->Length(); i++)
+		{
+			CString		name(names->Get(i));
+
+			attnamelist = lappend(attnamelist, makeString(pstrdup(name)));
+		}
+	}
+	else if (!args[1]->IsUndefined() && !args[1]->IsNull())
+		throw js_error("columns must be an array of column names");
+
+	state.nrows = 0;
+	state.pos = 0;
+	state.done = false;
+	state.natts = 0;
+	if (rows->IsArray())
+	{
+		state.rows = Local<Array>::Cast(rows);
+		state.nrows = state.rows->Length();
+	}
+	else if (rows->IsObject())
+	{
+		Local<v8::Object>	obj = Local<v8::Object>::Cast(rows);
+		Local<v8::Value>	next = obj->Get(String::NewFromUtf8(isolate, "next", String::kInternalizedString));
+		Local<v8::Value>	iter = obj->Get(Symbol::GetIterator(isolate));
+
+		/* an iterable such as a Set or a transition table */
+		if (!next->IsFunction() && iter->IsFunction())
+		{
+			TryCatch			try_catch(isolate);
+			Local<v8::Value>	result;
+
+			if (!Local<Function>::Cast(iter)->Call(context, obj, 0, NULL).ToLocal(&result))
+				throw js_error(try_catch);
+			if (!result->IsObject())
+				throw js_error("iterator is not an object");
+			obj = Local<v8::Object>::Cast(result);
+			next = obj->Get(String::NewFromUtf8(isolate, "next", String::kInternalizedString));
+		}
+
+		if (next->IsFunction())
+		{
+			state.iterator = obj;
+			state.next = Local<Function>::Cast(next);
+		}
+		else
+			state.columnobj = obj;
+	}
+	else
+		throw js_error("rows must be an array, an iterator or an object of columns");
+
+	EnsureSPIConnected();
+
+	initStringInfo(&state.buf);
+	state.bufpos = 0;
+#if PG_VERSION_NUM < 110000
+	state.rowcontext = AllocSetContextCreate(ctx,
+											 "PLv8 Copy Context",
+											 ALLOCSET_DEFAULT_MINSIZE,
+											 ALLOCSET_DEFAULT_INITSIZE,
+											 ALLOCSET_DEFAULT_MAXSIZE);
+#else
+	state.rowcontext = AllocSetContextCreate(ctx,
+											 "PLv8 Copy Context",
+											 ALLOCSET_DEFAULT_SIZES);
+#endif
+
+	copy_state = &state;
+	PG_TRY();
+	{
+		if (options.subtransaction)
+			subtran.enter();
+		processed = plv8_copy_from(table, attnamelist, &state);
+	}
+	PG_CATCH();
+	{
+		copy_state = prev_state;
+		MemoryContextSwitchTo(ctx);
+		MemoryContextDelete(state.rowcontext);
+		if (!options.subtransaction)
+			AbortCall(ctx);
+		subtran.exit(false);
+		throw pg_error();
+	}
+	PG_END_TRY();
+	copy_state = prev_state;
+
+	if (options.subtransaction)
+		subtran.exit(true);
+	MemoryContextDelete(state.rowcontext);
+	pfree(state.buf.data);
+
+	args.GetReturnValue().Set(Number::New(isolate, processed));
+}
+#endif
+
+/*
+ * A plan of plv8.prepare(), held by the PreparedPlan object.  The plan, its
+ * parameter state and the types of its parameters stay in mcontext until
+ * plan.free(), until the object is garbage collected, or until its context
+ * is disposed, so that plans the code forgets to free do not pile up for
+ * the life of the backend.  The live plans are listed in their context.
+ */
+typedef struct plv8_plan
+{
+	plv8_context		   *context;
+	SPIPlanPtr				plan;
+	plv8_param_state	   *parstate;	/* for the deduced parameter types */
+	int						nargs;
+	plv8_type			   *argtypes;	/* looked up on the first run */
+	MemoryContext			mcontext;
+	Persistent<v8::Object>	handle;		/* weak */
+} plv8_plan;
+
+/*
+ * The memory a saved plan is reckoned to hold outside of the V8 heap.  V8 is
+ * told about it, so that garbage collection runs for plans alone, instead of
+ * only when the small PreparedPlan objects fill the heap.
+ */
+#define PLV8_PLAN_EXTERNAL_SIZE	(32 * 1024)
+
+static int
+plv8_free_plan(plv8_plan *plan)
+{
+	int		status;
+
+	plan->handle.Reset();
+	plan->context->isolate->AdjustAmountOfExternalAllocatedMemory(
+		-PLV8_PLAN_EXTERNAL_SIZE);
+	plan->context->plans = list_delete_ptr(plan->context->plans, plan);
+	status = SPI_freeplan(plan->plan);
+	MemoryContextDelete(plan->mcontext);
+
+	return status;
+}
+
+/*
+ * Free the plans of context that are still alive.
+ */
+void
+plv8_release_plans(plv8_context *context)
+{
+	while (context->plans != NIL)
+		plv8_free_plan((plv8_plan *) linitial(context->plans));
+}
+
+/*
+ * Frees the plan of a PreparedPlan that has been garbage collected.  This is
+ * done in the first pass, as the second pass would wait for a message loop
+ * that nobody runs.  It only calls into PostgreSQL, and an error has nowhere
+ * to go in the middle of a garbage collection, so it is dropped.
+ */
+static void
+plv8_plan_weak_callback(const WeakCallbackInfo<plv8_plan> &data)
+{
+	plv8_plan	   *plan = data.GetParameter();
+	MemoryContext	ctx = CurrentMemoryContext;
+
+	PG_TRY();
+	{
+		plv8_free_plan(plan);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(ctx);
+		FlushErrorState();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * The types of the parameters of plan, looked up once for all of its runs.
+ */
+static plv8_type *
+plv8_plan_argtypes(plv8_plan *plan)
+{
+	if (plan->argtypes == NULL)
+	{
+		plv8_type  *types = (plv8_type *)
+			MemoryContextAllocZero(plan->mcontext,
+								   sizeof(plv8_type) * Max(plan->nargs, 1));
+
+		for (int i = 0; i < plan->nargs; i++)
+		{
+			Oid		typid;
+
+			if (plan->parstate)
+				typid = plan->parstate->paramTypes[i];
+			else
+				typid = SPI_getargtypeid(plan->plan, i);
+			plv8_fill_type(&types[i], typid, plan->mcontext);
+		}
+		plan->argtypes = types;
+	}
+
+	return plan->argtypes;
+}
+
+static plv8_plan *
+GetPlan(Handle<v8::Object> self)
+{
+	plv8_plan	   *plan = static_cast<plv8_plan *>(
+			Handle<External>::Cast(self->GetInternalField(0))->Value());
+
+	if (plan == NULL)
+		throw js_error("plan unexpectedly null");
+
+	return plan;
+}
+
+/*
+ * Convert the parameters of a run of plan.
+ */
+static void
+GetPlanParams(plv8_plan *plan, Handle<Array> params, Datum *values, char *nulls)
+{
+	plv8_type	   *types;
+
+	PG_TRY();
+	{
+		types = plv8_plan_argtypes(plan);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	for (int i = 0; i < plan->nargs; i++)
+		values[i] = value_get_datum(params->Get(i), &types[i], &nulls[i]);
+}
+
+/*
+ * plv8.prepare(statement, args...)
+ */
+static void
+plv8_Prepare(const FunctionCallbackInfo<v8::Value> &args)
+{
+	Isolate *		isolate = args.GetIsolate();
+	SPIPlanPtr		initial = NULL, saved;
+	CString			sql(args[0]);
+	Handle<Array>	array;
+	int				arraylen = 0;
+	Oid			   *types = NULL;
+	plv8_param_state *parstate = NULL;
+	MemoryContext	mcontext;
+	plv8_plan	   *plan;
+
+	if (args.Length() > 1)
+	{
+		if (args[1]->IsArray())
+			array = Handle<Array>::Cast(args[1]);
+		else /* Consume trailing elements as an array. */
+			array = convertArgsToArray(args, 1, 0);
+		arraylen = array->Length();
+		types = (Oid *) palloc(sizeof(Oid) * arraylen);
+	}
+
+	EnsureSPIConnected();
+
+	for (int i = 0; i < arraylen; i++)
+	{
+		CString			typestr(array->Get(i));
+		int32			typemod;
+
+#if PG_VERSION_NUM >= 90400
+		parseTypeString(typestr, &types[i], &typemod, false);
+#else
+		parseTypeString(typestr, &types[i], &typemod);
+#endif
+	}
+
+	/* the parameter state is used again when the plan is replanned */
+#if PG_VERSION_NUM < 110000
+	mcontext = AllocSetContextCreate(TopMemoryContext,
+									 "PLv8 Plan Context",
+									 ALLOCSET_SMALL_MINSIZE,
+									 ALLOCSET_SMALL_INITSIZE,
+									 ALLOCSET_SMALL_MAXSIZE);
+#else
+	mcontext = AllocSetContextCreate(TopMemoryContext,
+									 "PLv8 Plan Context",
+									 ALLOCSET_SMALL_SIZES);
+#endif
+
+	PG_TRY();
+	{
+		MemoryContext	oldcontext;
+
+#if PG_VERSION_NUM >= 90000
+		if (args.Length() == 1)
+		{
+			parstate = (plv8_param_state *)
+				MemoryContextAllocZero(mcontext, sizeof(plv8_param_state));
+			parstate->memcontext = mcontext;
+			initial = SPI_prepare_params(sql, plv8_variable_param_setup,
+										 parstate, 0);
+		}
+		else
+#endif
+			initial = SPI_prepare(sql, arraylen, types);
+		saved = SPI_saveplan(initial);
+		SPI_freeplan(initial);
+		plan = (plv8_plan *) MemoryContextAllocZero(mcontext, sizeof(plv8_plan));
+
+		oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		current_context->plans = lappend(current_context->plans, plan);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PG_CATCH();
+	{
+		MemoryContextDelete(mcontext);
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	new(&plan->handle) Persistent<v8::Object>();
+	plan->context = current_context;
+	plan->plan = saved;
+	plan->parstate = parstate;
+	plan->nargs = parstate ? parstate->numParams : SPI_getargcount(saved);
+	plan->mcontext = mcontext;
+
+	Local<ObjectTemplate> templ = Local<ObjectTemplate>::New(isolate, current_context->plan_template);
+
+	Local<v8::Object> result = templ->NewInstance(isolate->GetCurrentContext()).ToLocalChecked();
+	result->SetInternalField(0, External::New(isolate, plan));
+	plan->handle.Reset(isolate, result);
+	plan->handle.SetWeak(plan, plv8_plan_weak_callback,
+						 WeakCallbackType::kParameter);
+	isolate->AdjustAmountOfExternalAllocatedMemory(PLV8_PLAN_EXTERNAL_SIZE);
+
+	args.GetReturnValue().Set(result);
+}
+
+/*
+ * plan.cursor(args, ...)
+ */
+static void
+plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 {
 	Isolate *			isolate = args.GetIsolate();
-	Handle<v8::Object>	self = args.This();
-	SPIPlanPtr			plan;
+	plv8_plan		   *plan = GetPlan(args.This());
 	Datum			   *values = NULL;
 	char			   *nulls = NULL;
-	int					nparam = 0, argcount;
+	int					nparam = 0;
 	Handle<Array>		params;
 	Portal				cursor;
-	plv8_param_state   *parstate = NULL;
-
-	plan = static_cast<SPIPlanPtr>(
-			Handle<External>::Cast(self->GetInternalField(0))->Value());
-
-	if (plan == NULL) {
-		StringInfoData	buf;
 
-		initStringInfo(&buf);
-		appendStringInfo(&buf,
-				"plan unexpectedly null");
-		throw js_error(pstrdup(buf.data));
-	}
-	/* XXX: Add plan validation */
+	EnsureSPIConnected();
 
 	if (args.Length() > 0)
 	{
@@ -710,24 +2341,13 @@ plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 		nparam = params->Length();
 	}
 
-	/*
-	 * If the plan has the variable param info, use it.
-	 */
-	parstate = static_cast<plv8_param_state *>(
-			Handle<External>::Cast(self->GetInternalField(1))->Value());
-
-	if (parstate)
-		argcount = parstate->numParams;
-	else
-		argcount = SPI_getargcount(plan);
-
-	if (argcount != nparam)
+	if (plan->nargs != nparam)
 	{
 		StringInfoData	buf;
 
 		initStringInfo(&buf);
 		appendStringInfo(&buf,
-				"plan expected %d argument(s), given is %d", argcount, nparam);
+				"plan expected %d argument(s), given is %d", plan->nargs, nparam);
 		throw js_error(pstrdup(buf.data));
 	}
 
@@ -735,34 +2355,22 @@ plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 	{
 		values = (Datum *) palloc(sizeof(Datum) * nparam);
 		nulls = (char *) palloc(sizeof(char) * nparam);
-	}
-
-	for (int i = 0; i < nparam; i++)
-	{
-		Handle<v8::Value>	param = params->Get(i);
-		Oid					typid;
-
-		if (parstate)
-			typid = parstate->paramTypes[i];
-		else
-			typid = SPI_getargtypeid(plan, i);
-
-		values[i] = value_get_datum(param, typid, &nulls[i]);
+		GetPlanParams(plan, params, values, nulls);
 	}
 
 	PG_TRY();
 	{
 #if PG_VERSION_NUM >= 90000
-		if (parstate)
+		if (plan->parstate)
 		{
 			ParamListInfo	paramLI;
 
-			paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
-			cursor = SPI_cursor_open_with_paramlist(NULL, plan, paramLI, false);
+			paramLI = plv8_setup_variable_paramlist(plan->parstate, values, nulls);
+			cursor = SPI_cursor_open_with_paramlist(NULL, plan->plan, paramLI, false);
 		}
 		else
 #endif
-			cursor = SPI_cursor_open(NULL, plan, values, nulls, false);
+			cursor = SPI_cursor_open(NULL, plan->plan, values, nulls, false);
 	}
 	PG_CATCH();
 	{
@@ -781,51 +2389,43 @@ plv8_PlanCursor(const FunctionCallbackInfo<v8::Value> &args)
 
 /*
  * plan.execute(args, ...)
+ * plan.execute([args], options)
  */
 static void
 plv8_PlanExecute(const FunctionCallbackInfo<v8::Value> &args)
 {
-	Handle<v8::Object>	self = args.This();
-	SPIPlanPtr			plan;
+	plv8_plan		   *plan = GetPlan(args.This());
 	Datum			   *values = NULL;
 	char			   *nulls = NULL;
-	int					nparam = 0, argcount;
+	int					nparam = 0;
 	Handle<Array>		params;
 	SubTranBlock		subtran;
 	int					status;
-	plv8_param_state   *parstate = NULL;
+	plv8_spi_options	options;
 
-	plan = static_cast<SPIPlanPtr>(
-			Handle<External>::Cast(self->GetInternalField(0))->Value());
-	/* XXX: Add plan validation */
+	EnsureSPIConnected();
 
+	GetSPIOptions(Handle<v8::Value>(), &options);
 	if (args.Length() > 0)
 	{
 		if (args[0]->IsArray())
+		{
 			params = Handle<Array>::Cast(args[0]);
+			if (args.Length() >= 2)
+				GetSPIOptions(args[1], &options);
+		}
 		else
 			params = convertArgsToArray(args, 0, 0);
 		nparam = params->Length();
 	}
 
-	/*
-	 * If the plan has the variable param info, use it.
-	 */
-	parstate = static_cast<plv8_param_state *>(
-			Handle<External>::Cast(self->GetInternalField(1))->Value());
-
-	if (parstate)
-		argcount = parstate->numParams;
-	else
-		argcount = SPI_getargcount(plan);
-
-	if (argcount != nparam)
+	if (plan->nargs != nparam)
 	{
 		StringInfoData	buf;
 
 		initStringInfo(&buf);
 		appendStringInfo(&buf,
-				"plan expected %d argument(s), given is %d", argcount, nparam);
+				"plan expected %d argument(s), given is %d", plan->nargs, nparam);
 		throw js_error(pstrdup(buf.data));
 	}
 
@@ -833,49 +2433,76 @@ plv8_PlanExecute(const FunctionCallbackInfo<v8::Value> &args)
 	{
 		values = (Datum *) palloc(sizeof(Datum) * nparam);
 		nulls = (char *) palloc(sizeof(char) * nparam);
+		GetPlanParams(plan, params, values, nulls);
 	}
 
-	for (int i = 0; i < nparam; i++)
-	{
-		Handle<v8::Value>	param = params->Get(i);
-		Oid					typid;
-
-		if (parstate)
-			typid = parstate->paramTypes[i];
-		else
-			typid = SPI_getargtypeid(plan, i);
-
-		values[i] = value_get_datum(param, typid, &nulls[i]);
-	}
+	MemoryContext	ctx = CurrentMemoryContext;
 
 	PG_TRY();
 	{
-		subtran.enter();
+		if (options.subtransaction)
+			subtran.enter();
 #if PG_VERSION_NUM >= 90000
-		if (parstate)
+		if (plan->parstate)
 		{
 			ParamListInfo	paramLI;
 
-			paramLI = plv8_setup_variable_paramlist(parstate, values, nulls);
-			status = SPI_execute_plan_with_paramlist(plan, paramLI, false, 0);
+			paramLI = plv8_setup_variable_paramlist(plan->parstate, values, nulls);
+			status = SPI_execute_plan_with_paramlist(plan->plan, paramLI, false, 0);
 		}
 		else
 #endif
-			status = SPI_execute_plan(plan, values, nulls, false, 0);
+			status = SPI_execute_plan(plan->plan, values, nulls, false, 0);
 	}
 	PG_CATCH();
 	{
+		if (!options.subtransaction)
+			AbortCall(ctx);
 		subtran.exit(false);
 		throw pg_error();
 	}
 	PG_END_TRY();
 
-	subtran.exit(true);
+	if (options.subtransaction)
+		subtran.exit(true);
 
-	args.GetReturnValue().Set(SPIResultToValue(status));
+	args.GetReturnValue().Set(SPIResultToValue(status, options.columnar));
 	SPI_freetuptable(SPI_tuptable);
 }
 
+/*
+ * plan.execute_batch(rows)
+ * plan.execute_batch(rows, options)
+ */
+static void
+plv8_PlanExecuteBatch(const FunctionCallbackInfo<v8::Value> &args)
+{
+	plv8_plan		   *plan;
+	plv8_type		   *types;
+	plv8_spi_options	options;
+
+	if (args.Length() < 1)
+		throw js_error("usage: plan.execute_batch(rows[, options])");
+
+	plan = GetPlan(args.This());
+
+	GetSPIOptions(args.Length() >= 2 ? args[1] : Handle<v8::Value>(), &options);
+	EnsureSPIConnected();
+
+	PG_TRY();
+	{
+		types = plv8_plan_argtypes(plan);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	args.GetReturnValue().Set(ExecuteBatch(plan->plan, plan->parstate, args[0],
+										   &options, types));
+}
+
 /*
  * plan.free()
  */
@@ -884,25 +2511,17 @@ plv8_PlanFree(const FunctionCallbackInfo<v8::Value> &args)
 {
 	Isolate *			isolate = args.GetIsolate();
 	Handle<v8::Object>	self = args.This();
-	SPIPlanPtr			plan;
-	plv8_param_state   *parstate;
+	plv8_plan		   *plan;
 	int					status = 0;
 
-	plan = static_cast<SPIPlanPtr>(
+	plan = static_cast<plv8_plan *>(
 			Handle<External>::Cast(self->GetInternalField(0))->Value());
 
 	if (plan)
-		status = SPI_freeplan(plan);
+		status = plv8_free_plan(plan);
 
 	self->SetInternalField(0, External::New(isolate, 0));
 
-	parstate = static_cast<plv8_param_state *>(
-			Handle<External>::Cast(self->GetInternalField(1))->Value());
-
-	if (parstate)
-		pfree(parstate);
-	self->SetInternalField(1, External::New(isolate, 0));
-
 	args.GetReturnValue().Set(Int32::New(isolate, status));
 }
 
@@ -922,6 +2541,8 @@ plv8_CursorFetch(const FunctionCallbackInfo<v8::Value> &args)
 	if (!cursor)
 		throw js_error("cannot find cursor");
 
+	EnsureSPIConnected();
+
 	if (args.Length() >= 1)
 	{
 		wantarray = true;
@@ -998,6 +2619,8 @@ plv8_CursorMove(const FunctionCallbackInfo<v8::Value>& args)
 		forward = false;
 	}
 
+	EnsureSPIConnected();
+
 	PG_TRY();
 	{
 		SPI_cursor_move(cursor, forward, nmove);
@@ -1011,6 +2634,192 @@ plv8_CursorMove(const FunctionCallbackInfo<v8::Value>& args)
 	args.GetReturnValue().Set(Undefined(isolate));
 }
 
+/*
+ * Whether the iterator was opened in the current transaction.  Its cursor
+ * and Converter end with the transaction, and the name of the cursor may
+ * be taken by another one after that.
+ */
+static bool
+IteratorIsCurrent(Handle<v8::Object> self)
+{
+	Isolate *			isolate = Isolate::GetCurrent();
+
+	return self->GetInternalField(PLV8_ITER_XACT)->NumberValue(
+		isolate->GetCurrentContext()).ToChecked() == (double) plv8_xact_count;
+}
+
+/*
+ * Close the cursor of an iterator, if it is still open, and delete its
+ * Converter.
+ */
+static void
+CloseIterator(Handle<v8::Object> self)
+{
+	Isolate *			isolate = Isolate::GetCurrent();
+	Local<v8::Value>	name = self->GetInternalField(PLV8_ITER_CURSOR);
+	Converter		   *conv = static_cast<Converter *>(
+			Handle<External>::Cast(self->GetInternalField(PLV8_ITER_CONV))->Value());
+
+	self->SetInternalField(PLV8_ITER_CURSOR, Null(isolate));
+	self->SetInternalField(PLV8_ITER_ROWS, Undefined(isolate));
+	self->SetInternalField(PLV8_ITER_POS, Int32::New(isolate, 0));
+	self->SetInternalField(PLV8_ITER_CONV, External::New(isolate, NULL));
+
+	if (!name->IsString() || !IteratorIsCurrent(self))
+		return;
+
+	if (conv != NULL)
+		ReleaseTransactionConverter(conv);
+
+	CString				cname(name);
+
+	PG_TRY();
+	{
+		Portal			cursor = SPI_cursor_find(cname);
+
+		if (cursor)
+			SPI_cursor_close(cursor);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Fetch and convert the next batch of rows of an iterator.  Returns
+ * undefined, and closes the cursor, when there are no more rows.
+ */
+static Local<v8::Value>
+FetchIteratorRows(Handle<v8::Object> self)
+{
+	Isolate *			isolate = Isolate::GetCurrent();
+	Local<v8::Value>	name = self->GetInternalField(PLV8_ITER_CURSOR);
+	Converter		   *conv = static_cast<Converter *>(
+			Handle<External>::Cast(self->GetInternalField(PLV8_ITER_CONV))->Value());
+
+	if (!name->IsString())
+		return Undefined(isolate);
+
+	if (!IteratorIsCurrent(self) || conv == NULL)
+	{
+		CloseIterator(self);
+		return Undefined(isolate);
+	}
+
+	CString				cname(name);
+	Portal				cursor = SPI_cursor_find(cname);
+
+	if (!cursor)
+		throw js_error("cannot find cursor");
+
+	EnsureSPIConnected();
+
+	PG_TRY();
+	{
+		SPI_cursor_fetch(cursor, true, PLV8_ITER_BATCH_SIZE);
+	}
+	PG_CATCH();
+	{
+		throw pg_error();
+	}
+	PG_END_TRY();
+
+	if (SPI_processed == 0)
+	{
+		SPI_freetuptable(SPI_tuptable);
+		CloseIterator(self);
+		return Undefined(isolate);
+	}
+
+	int					nrows = SPI_processed;
+	Local<Array>		rows = Array::New(isolate, nrows);
+
+	for (int r = 0; r < nrows; r++)
+		rows->Set(r, conv->ToValue(SPI_tuptable->vals[r]));
+	SPI_freetuptable(SPI_tuptable);
+
+	self->SetInternalField(PLV8_ITER_ROWS, rows);
+	return rows;
+}
+
+static Local<v8::Object>
+IteratorResult(Handle<v8::Value> value, bool done)
+{
+	Isolate *			isolate = Isolate::GetCurrent();
+	Local<v8::Object>	result = v8::Object::New(isolate);
+
+	result->Set(String::NewFromUtf8(isolate, "value", String::kInternalizedString), value);
+	result->Set(String::NewFromUtf8(isolate, "done", String::kInternalizedString),
+				Boolean::New(isolate, done));
+	return result;
+}
+
+/*
+ * iterator.next()
+ */
+static void
+plv8_IteratorNext(const FunctionCallbackInfo<v8::Value> &args)
+{
+	Isolate *			isolate = args.GetIsolate();
+	Handle<v8::Object>	self = args.This();
+
+	/* the rows fetched are dropped with the cursor at the end of transaction */
+	if (!IteratorIsCurrent(self))
+		CloseIterator(self);
+
+	Local<v8::Value>	rows = self->GetInternalField(PLV8_ITER_ROWS);
+	int					pos = self->GetInternalField(PLV8_ITER_POS)->Int32Value(isolate->GetCurrentContext()).ToChecked();
+
+	if (!rows->IsArray() || pos >= (int) Local<Array>::Cast(rows)->Length())
+	{
+		rows = FetchIteratorRows(self);
+		pos = 0;
+	}
+
+	if (!rows->IsArray())
+	{
+		args.GetReturnValue().Set(IteratorResult(Undefined(isolate), true));
+		return;
+	}
+
+	self->SetInternalField(PLV8_ITER_POS, Int32::New(isolate, pos + 1));
+	args.GetReturnValue().Set(IteratorResult(Local<Array>::Cast(rows)->Get(pos), false));
+}
+
+/*
+ * iterator.return([value]), called when a for..of loop exits early.
+ */
+static void
+plv8_IteratorReturn(const FunctionCallbackInfo<v8::Value> &args)
+{
+	Isolate *			isolate = args.GetIsolate();
+
+	CloseIterator(args.This());
+	args.GetReturnValue().Set(IteratorResult(
+		args.Length() > 0 ? args[0] : Local<v8::Value>(Undefined(isolate)), true));
+}
+
+/*
+ * iterator.close()
+ */
+static void
+plv8_IteratorClose(const FunctionCallbackInfo<v8::Value> &args)
+{
+	CloseIterator(args.This());
+	args.GetReturnValue().Set(Undefined(args.GetIsolate()));
+}
+
+/*
+ * iterator[Symbol.iterator]()
+ */
+static void
+plv8_IteratorSelf(const FunctionCallbackInfo<v8::Value> &args)
+{
+	args.GetReturnValue().Set(args.This());
+}
+
 /*
  * cursor.close()
  */
@@ -1080,12 +2889,33 @@ plv8_Subtransaction(const FunctionCallbackInfo<v8::Value>& args)
 	Handle<Function>	func = Handle<Function>::Cast(args[0]);
 	SubTranBlock		subtran;
 
+	EnsureSPIConnected();
 	subtran.enter();
 
 	Handle<v8::Value> emptyargs[1] = {};
 	TryCatch try_catch(isolate);
 	MaybeLocal<v8::Value> result = func->Call(isolate->GetCurrentContext(), func, 0, emptyargs);
 
+	if (spi_pending_error != NULL)
+	{
+		ErrorData	   *edata = spi_pending_error;
+
+		/* a statement without a subtransaction failed; roll back ours */
+		spi_pending_error = NULL;
+		isolate->CancelTerminateExecution();
+		subtran.exit(false);
+
+		PG_TRY();
+		{
+			ReThrowError(edata);
+		}
+		PG_CATCH();
+		{
+			throw pg_error();
+		}
+		PG_END_TRY();
+	}
+
 	subtran.exit(!result.IsEmpty());
 
 	if (result.IsEmpty())
@@ -20,6 +20,8 @@ extern "C" {
 #include "utils/date.h"
 #include "utils/datetime.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #if PG_VERSION_NUM >= 90400
 #include "utils/jsonb.h"
 #endif
@@ -29,6 +31,10 @@ extern "C" {
 #include "nodes/memnodes.h"
 #include "utils/memutils.h"
 #include "fmgr.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#endif
 } // extern "C"
 
 
@@ -45,84 +51,181 @@ static Datum EpochToTimestampTz(double epoch);
 static double DateToEpoch(DateADT date);
 static Datum EpochToDate(double epoch);
 
-void
-plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
+/*
+ * Type information that depends only on the type OID is kept for the
+ * backend, so that a new FmgrInfo or converter for a known type needs no
+ * catalog lookups.  An invalidation of a pg_type row only drops the entry of
+ * that type, as temporary tables make them common, and a reset of the
+ * catalog caches drops them all.
+ */
+typedef struct plv8_type_info
 {
-	bool    ispreferred;
+	Oid			typid;		/* hash key */
+	uint32		hashvalue;	/* of the pg_type syscache entry */
+	int16		len;
+	bool		byval;
+	char		align;
+	char		category;
+	Oid			elemid;		/* element type of arrays */
+	plv8_external_array_type ext_array;
+} plv8_type_info;
+
+static HTAB *plv8_type_info_hash = NULL;
 
-	if (!mcxt)
-		mcxt = CurrentMemoryContext;
-
-	type->typid = typid;
-	type->fn_input.fn_mcxt = type->fn_output.fn_mcxt = mcxt;
-	get_type_category_preferred(typid, &type->category, &ispreferred);
-	type->is_composite = (type->category == TYPCATEGORY_COMPOSITE);
-	get_typlenbyvalalign(typid, &type->len, &type->byval, &type->align);
+#if PG_VERSION_NUM >= 90200
+static void
+plv8_type_info_inval(Datum arg, int cacheid, uint32 hashvalue)
+#else
+static void
+plv8_type_info_inval(Datum arg, int cacheid, ItemPointer tuplePtr)
+#endif
+{
+	HASH_SEQ_STATUS		status;
+	plv8_type_info	   *info;
 
-	if (get_typtype(typid) == TYPTYPE_DOMAIN)
+	hash_seq_init(&status, plv8_type_info_hash);
+	while ((info = (plv8_type_info *) hash_seq_search(&status)) != NULL)
 	{
-		HeapTuple	tp;
-		Form_pg_type typtup;
+#if PG_VERSION_NUM >= 90200
+		if (hashvalue != 0 && info->hashvalue != hashvalue)
+			continue;
+#endif
+		hash_search(plv8_type_info_hash, &info->typid, HASH_REMOVE, NULL);
+	}
+}
+
+static plv8_external_array_type
+plv8_external_array_of(Oid typid)
+{
+	HeapTuple	tp;
+	Form_pg_type typtup;
+	plv8_external_array_type ext_array = (plv8_external_array_type) 0;
 
 #if PG_VERSION_NUM < 90100
-		tp = SearchSysCache(TYPEOID, ObjectIdGetDatum(typid), 0, 0, 0);
+	tp = SearchSysCache(TYPEOID, ObjectIdGetDatum(typid), 0, 0, 0);
 #else
-		tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+	tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
 #endif
-		if (HeapTupleIsValid(tp))
-		{
-			/*
-			 * Check if the type is the external array types.
-			 */
-			typtup = (Form_pg_type) GETSTRUCT(tp);
-			if (strcmp(NameStr(typtup->typname),
-						"plv8_int2array") == 0)
-			{
-				type->ext_array = kExternalShortArray;
-			}
-			else if (strcmp(NameStr(typtup->typname),
-						"plv8_int4array") == 0)
-			{
-				type->ext_array = kExternalIntArray;
-			}
-			else if (strcmp(NameStr(typtup->typname),
-						"plv8_float4array") == 0)
-			{
-				type->ext_array = kExternalFloatArray;
-			}
-			else if (strcmp(NameStr(typtup->typname),
-						"plv8_float8array") == 0)
-			{
-				type->ext_array = kExternalDoubleArray;
-			}
-			else if (strcmp(NameStr(typtup->typname),
-						"plv8_int8array") == 0)
-			{
-				type->ext_array = kExternalInt64Array;
-			}
+	if (!HeapTupleIsValid(tp))
+		elog(ERROR, "cache lookup failed for type %d", typid);
 
-			ReleaseSysCache(tp);
-		}
-		else
-			elog(ERROR, "cache lookup failed for type %d", typid);
+	/*
+	 * Check if the type is the external array types.
+	 */
+	typtup = (Form_pg_type) GETSTRUCT(tp);
+	if (strcmp(NameStr(typtup->typname),
+				"plv8_int2array") == 0)
+	{
+		ext_array = kExternalShortArray;
+	}
+	else if (strcmp(NameStr(typtup->typname),
+				"plv8_int4array") == 0)
+	{
+		ext_array = kExternalIntArray;
+	}
+	else if (strcmp(NameStr(typtup->typname),
+				"plv8_float4array") == 0)
+	{
+		ext_array = kExternalFloatArray;
+	}
+	else if (strcmp(NameStr(typtup->typname),
+				"plv8_float8array") == 0)
+	{
+		ext_array = kExternalDoubleArray;
+	}
+	else if (strcmp(NameStr(typtup->typname),
+				"plv8_int8array") == 0)
+	{
+		ext_array = kExternalInt64Array;
+	}
+
+	ReleaseSysCache(tp);
+	return ext_array;
+}
+
+static void
+plv8_get_type_info(Oid typid, plv8_type_info *info)
+{
+	plv8_type_info	   *entry;
+	bool				ispreferred;
 
-		if (type->ext_array)
-			return;
+	if (plv8_type_info_hash == NULL)
+	{
+		HASHCTL    hash_ctl = { 0 };
+
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(plv8_type_info);
+		hash_ctl.hash = oid_hash;
+		plv8_type_info_hash = hash_create("PLv8 Types", 64,
+										  &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+		CacheRegisterSyscacheCallback(TYPEOID, plv8_type_info_inval, (Datum) 0);
+	}
 
-		/* If not, do as usual. */
+	entry = (plv8_type_info *)
+		hash_search(plv8_type_info_hash, &typid, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*info = *entry;
+		return;
 	}
 
+	/*
+	 * Look everything up before entering the hash, as the lookups may
+	 * process invalidations that flush it.
+	 */
+	memset(info, 0, sizeof(plv8_type_info));
+	info->typid = typid;
+	get_type_category_preferred(typid, &info->category, &ispreferred);
+	get_typlenbyvalalign(typid, &info->len, &info->byval, &info->align);
+	if (get_typtype(typid) == TYPTYPE_DOMAIN)
+		info->ext_array = plv8_external_array_of(typid);
+	if (info->category == TYPCATEGORY_ARRAY)
+		info->elemid = get_element_type(typid);
+#if PG_VERSION_NUM >= 90200
+	info->hashvalue = GetSysCacheHashValue1(TYPEOID, ObjectIdGetDatum(typid));
+#endif
+
+	entry = (plv8_type_info *)
+		hash_search(plv8_type_info_hash, &typid, HASH_ENTER, NULL);
+	*entry = *info;
+}
+
+void
+plv8_fill_type(plv8_type *type, Oid typid, MemoryContext mcxt)
+{
+	plv8_type_info	info;
+
+	if (!mcxt)
+		mcxt = CurrentMemoryContext;
+
+	plv8_get_type_info(typid, &info);
+
+	type->typid = typid;
+	type->fn_input.fn_mcxt = type->fn_output.fn_mcxt = mcxt;
+	type->category = info.category;
+	type->is_composite = (type->category == TYPCATEGORY_COMPOSITE);
+	type->len = info.len;
+	type->byval = info.byval;
+	type->align = info.align;
+	type->ext_array = info.ext_array;
+
+	if (type->ext_array)
+		return;
+
 	if (type->category == TYPCATEGORY_ARRAY)
 	{
-		Oid      elemid = get_element_type(typid);
+		Oid      elemid = info.elemid;
 
 		if (elemid == InvalidOid)
 			ereport(ERROR,
 				(errmsg("cannot determine element type of array: %u", typid)));
 
+		plv8_get_type_info(elemid, &info);
 		type->typid = elemid;
-		type->is_composite = (TypeCategory(elemid) == TYPCATEGORY_COMPOSITE);
-		get_typlenbyvalalign(type->typid, &type->len, &type->byval, &type->align);
+		type->is_composite = (info.category == TYPCATEGORY_COMPOSITE);
+		type->len = info.len;
+		type->byval = info.byval;
+		type->align = info.align;
 	}
 }
 
@@ -880,6 +983,7 @@ ToRecordDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 {
 	Datum		result;
 	TupleDesc	tupdesc;
+	std::unique_ptr<Converter>	temp;
 
 	if (value->IsUndefined() || value->IsNull())
 	{
@@ -897,9 +1001,7 @@ ToRecordDatum(Handle<v8::Value> value, bool *isnull, plv8_type *type)
 	}
 	PG_END_TRY();
 
-	Converter	conv(tupdesc);
-
-	result = conv.ToDatum(value);
+	result = GetConverter(tupdesc, temp)->ToDatum(value);
 
 	ReleaseTupleDesc(tupdesc);
 
@@ -1054,15 +1156,18 @@ ToArrayValue(Datum datum, bool isnull, plv8_type *type)
 						&values, &nulls, &nelems);
 	Local<Array>  result = Array::New(Isolate::GetCurrent(), nelems);
 	plv8_type base = { 0 };
-	bool    ispreferred;
+	plv8_type_info info;
 
 	base.typid = type->typid;
 	if (base.typid == RECORDARRAYOID)
 		base.typid = RECORDOID;
 
 	base.fn_input.fn_mcxt = base.fn_output.fn_mcxt = type->fn_input.fn_mcxt;
-	get_type_category_preferred(base.typid, &(base.category), &ispreferred);
-	get_typlenbyvalalign(base.typid, &(base.len), &(base.byval), &(base.align));
+	plv8_get_type_info(base.typid, &info);
+	base.category = info.category;
+	base.len = info.len;
+	base.byval = info.byval;
+	base.align = info.align;
 
 	for (int i = 0; i < nelems; i++)
 		result->Set(i, ToValue(values[i], nulls[i], &base));
@@ -1081,6 +1186,7 @@ ToRecordValue(Datum datum, bool isnull, plv8_type *type)
 	int32			tupTypmod;
 	TupleDesc		tupdesc;
 	HeapTupleData	tuple;
+	std::unique_ptr<Converter>	temp;
 
 	PG_TRY();
 	{
@@ -1095,7 +1201,7 @@ ToRecordValue(Datum datum, bool isnull, plv8_type *type)
 	}
 	PG_END_TRY();
 
-	Converter	conv(tupdesc);
+	Converter  *conv = GetConverter(tupdesc, temp);
 
 	/* Build a temporary HeapTuple control structure */
 	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
@@ -1103,7 +1209,7 @@ ToRecordValue(Datum datum, bool isnull, plv8_type *type)
 	tuple.t_tableOid = InvalidOid;
 	tuple.t_data = rec;
 
-	Local<v8::Value> result = conv.ToValue(&tuple);
+	Local<v8::Value> result = conv->ToValue(&tuple);
 
 	ReleaseTupleDesc(tupdesc);
 
@@ -1143,14 +1249,14 @@ ToString(Datum value, plv8_type *type)
 	return result;
 }
 
-Local<String>
-ToString(const char *str, int len, int encoding)
+static Local<String>
+ToString(const char *str, int len, int encoding, String::NewStringType type)
 {
 	char		   *utf8;
 	Isolate		   *isolate = Isolate::GetCurrent();
 
 	if (str == NULL) {
-		return String::NewFromUtf8(isolate, "(null)", String::kNormalString, 6);
+		return String::NewFromUtf8(isolate, "(null)", type, 6);
 	}
 	if (len < 0)
 		len = strlen(str);
@@ -1168,12 +1274,28 @@ ToString(const char *str, int len, int encoding)
 
 	if (utf8 != str)
 		len = strlen(utf8);
-	Local<String> result = String::NewFromUtf8(isolate, utf8, String::kNormalString, len);
+	Local<String> result = String::NewFromUtf8(isolate, utf8, type, len);
 	if (utf8 != str)
 		pfree(utf8);
 	return result;
 }
 
+Local<String>
+ToString(const char *str, int len, int encoding)
+{
+	return ToString(str, len, encoding, String::kNormalString);
+}
+
+/*
+ * Same as ToString(), but the result is internalized, so that repeated
+ * lookups of it as a property name compare by identity.
+ */
+Local<String>
+ToInternalizedString(const char *str)
+{
+	return ToString(str, -1, GetDatabaseEncoding(), String::kInternalizedString);
+}
+
 /*
  * Convert utf8 text to database encoded text.
  * The result could be same as utf8 input, or palloc'ed one.
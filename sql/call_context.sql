@@ -0,0 +1,40 @@
+-- every call runs in its own memory context, whether it uses SPI or not
+CREATE FUNCTION call_plain(i int) RETURNS int AS $$
+    return i * 2;
+$$ LANGUAGE plv8 STRICT;
+SELECT sum(call_plain(i)) FROM generate_series(1, 100000) i;
+
+CREATE FUNCTION call_join(a int[]) RETURNS text AS $$
+    return a.join(',');
+$$ LANGUAGE plv8 STRICT;
+SELECT sum(length(call_join(ARRAY[i, i]))) FROM generate_series(1, 100000) i;
+
+-- SPI is connected in the call context on some of the calls only
+CREATE FUNCTION call_some_spi(i int) RETURNS int AS $$
+    if (i % 10000 != 0)
+        return 0;
+    return plv8.execute('SELECT $1::int AS x', [i])[0].x;
+$$ LANGUAGE plv8 STRICT;
+SELECT sum(call_some_spi(i)) FROM generate_series(1, 100000) i;
+
+-- a call that fails in SPI leaves the caller usable
+CREATE FUNCTION call_fail() RETURNS int AS $$
+    return plv8.execute('SELECT 1/0 AS x')[0].x;
+$$ LANGUAGE plv8;
+DO $$
+    for (var i = 0; i < 3; i++) {
+        try {
+            plv8.subtransaction(function() {
+                plv8.execute('SELECT call_fail()');
+            });
+        } catch (e) {
+            plv8.elog(NOTICE, 'caught:', e.message);
+        }
+    }
+    plv8.elog(NOTICE, plv8.execute('SELECT call_plain(21) AS x')[0].x);
+$$ LANGUAGE plv8;
+
+DROP FUNCTION call_plain(int);
+DROP FUNCTION call_join(int[]);
+DROP FUNCTION call_some_spi(int);
+DROP FUNCTION call_fail();
@@ -0,0 +1,16 @@
+-- query cancel and statement_timeout must stop a running JS loop
+CREATE FUNCTION loop_forever(spin boolean) RETURNS boolean AS $$
+  while (spin) {}
+  return spin;
+$$ LANGUAGE plv8;
+
+SELECT loop_forever(false);
+SELECT pg_cancel_backend(pg_backend_pid()), loop_forever(true);
+
+SET statement_timeout = '1s';
+SELECT loop_forever(true);
+RESET statement_timeout;
+
+SELECT loop_forever(false);
+
+DROP FUNCTION loop_forever(boolean);
@@ -0,0 +1,26 @@
+SET plv8.code_cache = on;
+
+CREATE FUNCTION code_cache_add(a int, b int) RETURNS int AS $$
+    return a + b;
+$$ LANGUAGE plv8;
+
+SELECT code_cache_add(1, 2);
+
+-- a fresh context compiles the function again, from the cache this time
+SELECT plv8_reset();
+SELECT code_cache_add(3, 4);
+SELECT (plv8_info()->0->'code_cache'->>'hits')::int > 0 AS code_cache_hit;
+
+-- versions of a function written by one transaction, with bodies of the
+-- same length, are told apart
+BEGIN;
+CREATE FUNCTION code_cache_version() RETURNS int AS $$ return 1; $$ LANGUAGE plv8;
+SELECT code_cache_version();
+CREATE OR REPLACE FUNCTION code_cache_version() RETURNS int AS $$ return 2; $$ LANGUAGE plv8;
+COMMIT;
+SELECT plv8_reset();
+SELECT code_cache_version();
+DROP FUNCTION code_cache_version();
+
+DROP FUNCTION code_cache_add(int, int);
+RESET plv8.code_cache;
@@ -0,0 +1,41 @@
+DO $$
+    function kind(v) { return Object.prototype.toString.call(v); }
+    var cols = plv8.execute(
+        'SELECT i::int2 AS s, i AS n, i / 2.0::float8 AS f, i::text AS t, nullif(i, 2) AS z ' +
+        'FROM generate_series(1, $1) i', [3], { columnar: true });
+    for (var name in cols)
+        plv8.elog(NOTICE, name, kind(cols[name]), JSON.stringify(Array.from(cols[name])));
+$$ LANGUAGE plv8;
+
+-- empty result still has every column
+DO $$
+    var cols = plv8.execute('SELECT 1 AS a, 2.5::float4 AS b WHERE false', [], { columnar: true });
+    plv8.elog(NOTICE, JSON.stringify(Object.keys(cols)), cols.a.length, cols.b.length);
+$$ LANGUAGE plv8;
+
+-- without the option, rows are returned
+DO $$
+    plv8.elog(NOTICE, JSON.stringify(plv8.execute('SELECT 1 AS a', [], { columnar: false })));
+$$ LANGUAGE plv8;
+
+DO $$
+    var plan = plv8.prepare('SELECT i FROM generate_series(1, $1) i', ['int']);
+    var cols = plan.execute([4], { columnar: true });
+    plv8.elog(NOTICE, Object.prototype.toString.call(cols.i), cols.i.reduce(function(a, b) { return a + b; }, 0));
+    plan.free();
+$$ LANGUAGE plv8;
+
+-- a wide result, with a numeric column that has a null in its last row
+DO $$
+    function kind(v) { return Object.prototype.toString.call(v); }
+    var list = [];
+    for (var c = 0; c < 30; c++)
+        list.push('i + ' + c + ' AS c' + c);
+    var cols = plv8.execute('SELECT ' + list.join(', ') + ', nullif(i, $1) AS z ' +
+        'FROM generate_series(1, $1) i', [100000], { columnar: true });
+    var sum = 0;
+    for (var c = 0; c < 30; c++)
+        sum += cols['c' + c][99999] - cols['c' + c][0];
+    plv8.elog(NOTICE, Object.keys(cols).length, kind(cols.c29), sum);
+    plv8.elog(NOTICE, kind(cols.z), cols.z.length, cols.z[99998], cols.z[99999]);
+$$ LANGUAGE plv8;
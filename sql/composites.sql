@@ -3,3 +3,32 @@ DO LANGUAGE PLV8 $$
   var jres = plv8.execute("select $1::acomp[]", [ [ { "x": 2, "z": null, "y": null } ] ]);
   plv8.elog(NOTICE,JSON.stringify(jres));
 $$;
+
+-- converters are kept per row type, and rebuilt when the type changes
+CREATE TABLE conv_rows (a int, b text);
+CREATE FUNCTION conv_rows_trig() RETURNS trigger AS $$
+  plv8.elog(NOTICE, JSON.stringify(NEW));
+  NEW.a = NEW.a * 10;
+  return NEW;
+$$ LANGUAGE plv8;
+CREATE TRIGGER conv_rows_trig BEFORE INSERT OR UPDATE ON conv_rows
+  FOR EACH ROW EXECUTE PROCEDURE conv_rows_trig();
+INSERT INTO conv_rows VALUES (1, 'one'), (2, 'two');
+ALTER TABLE conv_rows ADD COLUMN c int DEFAULT 7;
+ALTER TABLE conv_rows DROP COLUMN b;
+INSERT INTO conv_rows VALUES (3);
+UPDATE conv_rows SET a = a + 1 WHERE a = 10;
+SELECT * FROM conv_rows ORDER BY a;
+DROP TABLE conv_rows;
+DROP FUNCTION conv_rows_trig();
+
+CREATE TYPE conv_comp AS (x int, y text);
+CREATE FUNCTION conv_comp_echo(v conv_comp) RETURNS conv_comp AS $$
+  plv8.elog(NOTICE, JSON.stringify(v));
+  return v;
+$$ LANGUAGE plv8;
+SELECT conv_comp_echo(ROW(1, 'a')::conv_comp);
+ALTER TYPE conv_comp ADD ATTRIBUTE z int;
+SELECT conv_comp_echo(ROW(2, 'b', 3)::conv_comp);
+DROP FUNCTION conv_comp_echo(conv_comp);
+DROP TYPE conv_comp;
@@ -0,0 +1,58 @@
+CREATE TABLE copy_test (id int CHECK (id < 1000), name text, tags text[], note text DEFAULT 'none');
+
+DO $$
+    var n = plv8.copy_from('copy_test', ['id', 'name', 'tags'],
+                           [[1, 'a', ['x', 'y']], [2, 'tab\there', null], [3, 'back\\slash\nline', []]]);
+    plv8.elog(NOTICE, n);
+$$ LANGUAGE plv8;
+SELECT id, replace(replace(name, E'\t', '<tab>'), E'\n', '<nl>') AS name, tags, note
+  FROM copy_test ORDER BY id;
+
+-- objects, by column name
+DO $$
+    plv8.elog(NOTICE, plv8.copy_from('copy_test', ['name', 'id'],
+                                     [{ id: 4, name: 'd' }, { id: 5 }]));
+$$ LANGUAGE plv8;
+
+-- columns, as returned in the columnar mode
+DO $$
+    plv8.elog(NOTICE, plv8.copy_from('public.copy_test', ['id', 'name'],
+                                     { id: new Int32Array([6, 7]), name: ['f', 'g'] }));
+$$ LANGUAGE plv8;
+
+-- an iterator, and all the columns
+DO $$
+    function* rows() {
+        for (var i = 8; i <= 10; i++)
+            yield [i, 'n' + i, null, 'gen'];
+    }
+    plv8.elog(NOTICE, plv8.copy_from('copy_test', null, rows()));
+    plv8.elog(NOTICE, plv8.copy_from('copy_test', null, new Set([[11, 'set', null, null]])));
+$$ LANGUAGE plv8;
+SELECT * FROM copy_test WHERE id > 3 ORDER BY id;
+
+-- a failed copy is rolled back
+DO $$
+    var errors = [];
+    function attempt(f) {
+        try {
+            f();
+        } catch (e) {
+            errors.push(e.message);
+        }
+    }
+    attempt(function() { plv8.copy_from('copy_test', ['id'], [[100], [1000]]); });
+    attempt(function() { plv8.copy_from('copy_test', ['id', 'name'], [[100, 'a'], [101]]); });
+    attempt(function() { plv8.copy_from('copy_test', ['id', 'missing'], []); });
+    attempt(function() { plv8.copy_from('no_such_table', null, []); });
+    attempt(function() {
+        plv8.copy_from('copy_test', ['id'], (function* () {
+            yield [100];
+            throw new Error('boom');
+        })());
+    });
+    errors.forEach(function(e) { plv8.elog(NOTICE, e); });
+$$ LANGUAGE plv8;
+SELECT count(*) FROM copy_test WHERE id >= 100;
+
+DROP TABLE copy_test;
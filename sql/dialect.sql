@@ -18,3 +18,12 @@ return plv8.find_function('v8func')(a);
 $$ LANGUAGE plls;
 
 SELECT lsfunc(11);
+
+-- translations are kept in the persistent cache
+SET plv8.code_cache = on;
+SELECT plv8_reset();
+SELECT lsfunc(12);
+SELECT plv8_reset();
+SELECT lsfunc(12);
+SELECT (plv8_info()->0->'dialect_cache'->>'hits')::int > 0 AS dialect_cache_hit;
+RESET plv8.code_cache;
@@ -0,0 +1,41 @@
+CREATE FUNCTION iter_sum(n int) RETURNS bigint AS $$
+    var sum = 0;
+    for (var row of plv8.execute_iter('SELECT i FROM generate_series(1, $1) i', [n]))
+        sum += row.i;
+    return sum;
+$$ LANGUAGE plv8;
+
+-- more than one batch
+SELECT iter_sum(2500);
+SELECT iter_sum(0);
+
+-- the statement is kept in the statement cache
+SELECT (plv8_info()->0->'statement_cache'->>'hits')::int > 0 AS statement_hit;
+
+-- leaving the loop early closes the cursor
+DO $$
+    var it = plv8.execute_iter('SELECT i FROM generate_series(1, 10) i');
+    for (var row of it)
+        if (row.i == 3)
+            break;
+    plv8.elog(NOTICE, JSON.stringify(it.next()));
+$$ LANGUAGE plv8;
+
+DO $$
+    var it = plv8.execute_iter('SELECT $1::text AS a, $2::int AS b', 'x', 1);
+    plv8.elog(NOTICE, JSON.stringify(it.next()));
+    plv8.elog(NOTICE, JSON.stringify(it.next()));
+    it.close();
+$$ LANGUAGE plv8;
+
+-- an iterator ends with the transaction it was opened in
+DO $$
+    plv8.saved_iter = plv8.execute_iter('SELECT i FROM generate_series(1, 3) i');
+    plv8.elog(NOTICE, JSON.stringify(plv8.saved_iter.next()));
+$$ LANGUAGE plv8;
+DO $$
+    plv8.elog(NOTICE, JSON.stringify(plv8.saved_iter.next()));
+    delete plv8.saved_iter;
+$$ LANGUAGE plv8;
+
+DROP FUNCTION iter_sum(int);
@@ -0,0 +1,47 @@
+CREATE TABLE batch_test (id int, name text);
+
+DO $$
+    var n = plv8.execute_many('INSERT INTO batch_test VALUES ($1, $2)',
+                              [[1, 'a'], [2, 'b'], [3, null]]);
+    plv8.elog(NOTICE, n);
+$$ LANGUAGE plv8;
+SELECT * FROM batch_test ORDER BY id;
+
+-- columns, as returned in the columnar mode
+DO $$
+    var n = plv8.execute_many('INSERT INTO batch_test VALUES ($1, $2)',
+                              { id: new Int32Array([4, 5]), name: ['d', 'e'] });
+    plv8.elog(NOTICE, n);
+    var cols = plv8.execute('SELECT id + 10 AS id, name FROM batch_test WHERE id <= 2',
+                            [], { columnar: true });
+    plv8.elog(NOTICE, plv8.execute_many('INSERT INTO batch_test VALUES ($1, $2)', cols));
+$$ LANGUAGE plv8;
+SELECT count(*), sum(id) FROM batch_test;
+
+-- returned rows are put together
+DO $$
+    var plan = plv8.prepare('UPDATE batch_test SET name = $2 WHERE id = $1 RETURNING id, name',
+                            ['int', 'text']);
+    var rows = plan.execute_batch([[1, 'x'], [2, 'y'], [99, 'z']]);
+    plv8.elog(NOTICE, JSON.stringify(rows));
+    plan.free();
+$$ LANGUAGE plv8;
+
+-- the batch is atomic
+DO $$
+    try {
+        plv8.execute_many('INSERT INTO batch_test VALUES (100 / $1)', [[1], [0]]);
+    } catch (e) {
+        plv8.elog(NOTICE, e.message);
+    }
+$$ LANGUAGE plv8;
+SELECT count(*) FROM batch_test WHERE id = 100;
+
+DO $$
+    plv8.execute_many('INSERT INTO batch_test VALUES ($1, $2)', [[1, 'a'], [2]]);
+$$ LANGUAGE plv8;
+DO $$
+    plv8.execute_many('INSERT INTO batch_test VALUES ($1, $2)', { id: [1, 2], name: ['a'] });
+$$ LANGUAGE plv8;
+
+DROP TABLE batch_test;
@@ -0,0 +1,50 @@
+CREATE TABLE nosub (i int PRIMARY KEY);
+
+SET plv8.execute_subtransaction = off;
+DO $$
+    for (var i = 1; i <= 3; i++)
+        plv8.execute('INSERT INTO nosub VALUES ($1)', [i]);
+$$ LANGUAGE plv8;
+SELECT count(*) FROM nosub;
+
+-- an error aborts the transaction
+BEGIN;
+DO $$
+    plv8.execute('INSERT INTO nosub VALUES (4)');
+    plv8.execute('SELECT 1/0');
+$$ LANGUAGE plv8;
+SELECT count(*) FROM nosub;
+ROLLBACK;
+
+-- unless the statements run in plv8.subtransaction()
+DO $$
+    try {
+        plv8.subtransaction(function() {
+            plv8.execute('INSERT INTO nosub VALUES (5)');
+            plv8.execute('SELECT 1/0');
+        });
+    } catch (e) {
+        plv8.elog(NOTICE, 'rolled back:', e.message);
+    }
+    plv8.execute('INSERT INTO nosub VALUES (6)');
+$$ LANGUAGE plv8;
+SELECT i FROM nosub ORDER BY i;
+
+-- or ask for their own subtransaction
+DO $$
+    try {
+        plv8.execute('SELECT 1/0', [], { subtransaction: true });
+    } catch (e) {
+        plv8.elog(NOTICE, 'caught:', e.message);
+    }
+$$ LANGUAGE plv8;
+RESET plv8.execute_subtransaction;
+
+DO $$
+    var plan = plv8.prepare('INSERT INTO nosub VALUES ($1)', ['int']);
+    plan.execute([7], { subtransaction: false });
+    plan.execute([7], { subtransaction: false });
+$$ LANGUAGE plv8;
+SELECT count(*) FROM nosub WHERE i = 7;
+
+DROP TABLE nosub;
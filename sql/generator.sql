@@ -0,0 +1,49 @@
+CREATE FUNCTION gen_ints(n int) RETURNS SETOF int AS $$
+    return (function* () {
+        for (var i = 1; i <= n; i++) {
+            plv8.elog(NOTICE, 'yield', i);
+            yield i;
+        }
+    })();
+$$ LANGUAGE plv8;
+
+-- rows are produced as the executor asks for them
+SELECT gen_ints(5) LIMIT 2;
+SELECT gen_ints(3);
+SELECT gen_ints(0);
+SELECT * FROM gen_ints(2);
+
+CREATE TYPE gen_rec AS (i int, t text);
+CREATE FUNCTION gen_recs(n int) RETURNS SETOF gen_rec AS $$
+    return (function* () {
+        for (var i = 1; i <= n; i++)
+            yield { i: i, t: 'row ' + i };
+    })();
+$$ LANGUAGE plv8;
+
+SELECT (gen_recs(3)).*;
+SELECT * FROM gen_recs(3) WHERE i > 1;
+SELECT count(*) FROM (SELECT gen_ints(10) LIMIT 4) s;
+
+-- a generator after plv8.return_next() fills the same tuplestore
+CREATE FUNCTION gen_mixed() RETURNS SETOF int AS $$
+    plv8.return_next(1);
+    return (function* () { yield 2; yield 3; })();
+$$ LANGUAGE plv8;
+SELECT gen_mixed();
+
+-- errors in the generator are raised from the row that hits them
+CREATE FUNCTION gen_error() RETURNS SETOF int AS $$
+    return (function* () {
+        yield 1;
+        throw 'generator failed';
+    })();
+$$ LANGUAGE plv8;
+SELECT gen_error();
+SELECT gen_error() LIMIT 1;
+
+DROP FUNCTION gen_ints(int);
+DROP FUNCTION gen_recs(int);
+DROP TYPE gen_rec;
+DROP FUNCTION gen_mixed();
+DROP FUNCTION gen_error();
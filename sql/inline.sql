@@ -1,2 +1,10 @@
 DO $$ plv8.elog(NOTICE, 'this', 'is', 'inline', 'code') $$ LANGUAGE plv8;
 DO $$ plv8.return_next(new Object());$$ LANGUAGE plv8;
+
+-- repeated blocks are compiled once
+DO $$ plv8.elog(NOTICE, 'this', 'is', 'inline', 'code') $$ LANGUAGE plv8;
+SELECT (plv8_info()->0->'inline_cache'->>'hits')::int AS inline_cache_hits;
+SET plv8.inline_cache_size = 0;
+DO $$ plv8.elog(NOTICE, 'this', 'is', 'inline', 'code') $$ LANGUAGE plv8;
+SELECT (plv8_info()->0->'inline_cache'->>'hits')::int AS inline_cache_hits;
+RESET plv8.inline_cache_size;
@@ -0,0 +1,35 @@
+-- only the most recently used isolates are kept beyond plv8.max_isolates
+CREATE ROLE plv8_tenant_a;
+CREATE ROLE plv8_tenant_b;
+
+CREATE FUNCTION set_tenant_value(val text) RETURNS void AS $$
+    tenant_value = val;
+$$ LANGUAGE plv8;
+
+CREATE FUNCTION get_tenant_value() RETURNS text AS $$
+    return typeof tenant_value === 'undefined' ? null : tenant_value;
+$$ LANGUAGE plv8;
+
+SET plv8.max_isolates = 2;
+
+SET ROLE plv8_tenant_a;
+SELECT set_tenant_value('a');
+SET ROLE plv8_tenant_b;
+SELECT set_tenant_value('b');
+RESET ROLE;
+SELECT set_tenant_value('owner');
+
+-- the isolate of plv8_tenant_a was the least recently used one
+SELECT json_array_length(plv8_info());
+SET ROLE plv8_tenant_b;
+SELECT get_tenant_value();
+SET ROLE plv8_tenant_a;
+SELECT get_tenant_value();
+
+RESET ROLE;
+RESET plv8.max_isolates;
+
+DROP FUNCTION set_tenant_value(text);
+DROP FUNCTION get_tenant_value();
+DROP ROLE plv8_tenant_a;
+DROP ROLE plv8_tenant_b;
@@ -455,3 +455,18 @@ alter table plv8test drop column repro1;
 -- dropped columns should work with trigger
 update plv8test set repro2='test';
 
+
+-- replaced functions are recompiled on their next call
+CREATE FUNCTION replaced_version() RETURNS int AS $$ return 1; $$ LANGUAGE plv8;
+SELECT replaced_version();
+CREATE OR REPLACE FUNCTION replaced_version() RETURNS int AS $$ return 2; $$ LANGUAGE plv8;
+SELECT replaced_version();
+DROP FUNCTION replaced_version();
+
+-- rows of a large set are converted in a per-row memory context
+CREATE FUNCTION srf_many(n int) RETURNS TABLE (i int, t text) AS $$
+  for (var i = 0; i < n; i++)
+    plv8.return_next({ i: i, t: 'row ' + i });
+$$ LANGUAGE plv8;
+SELECT count(*), sum(length(t)) FROM srf_many(100000);
+DROP FUNCTION srf_many(int);
@@ -0,0 +1,62 @@
+CREATE TABLE plan_test (id int, name text);
+
+-- a plan kept across calls, with the parameter types deduced
+CREATE FUNCTION plan_insert(id int, name text) RETURNS int AS $$
+    if (!plv8.plan_insert)
+        plv8.plan_insert = plv8.prepare('INSERT INTO plan_test VALUES ($1, $2)');
+    return plv8.plan_insert.execute([id, name]);
+$$ LANGUAGE plv8;
+SELECT plan_insert(1, 'a');
+SELECT plan_insert(2, 'b');
+-- replanned after the table changes
+ALTER TABLE plan_test ADD COLUMN note text;
+SELECT plan_insert(3, 'c');
+SELECT * FROM plan_test ORDER BY id;
+
+-- the live plans of the context
+SELECT plv8_info()->0->>'plans' AS plans;
+DO $$
+    var plan = plv8.prepare('SELECT 1 AS n');
+    plan.execute();
+    plan.free();
+$$ LANGUAGE plv8;
+SELECT plv8_info()->0->>'plans' AS plans;
+
+-- plans that are not freed are garbage collected
+DO $$
+    var n = 0;
+    for (var i = 0; i < 10000; i++) {
+        var plan = plv8.prepare('SELECT $1::int + $2 AS n', ['int', 'int']);
+        n += plan.execute([i, 1])[0].n;
+    }
+    plv8.elog(NOTICE, n);
+$$ LANGUAGE plv8;
+SELECT (plv8_info()->0->>'plans')::int < 10000 AS plans_collected;
+
+-- a freed plan
+DO $$
+    var plan = plv8.prepare('SELECT $1::int AS n', ['int']);
+    var n = 0;
+    for (var i = 0; i < 3; i++)
+        n += plan.execute([i])[0].n;
+    plv8.elog(NOTICE, n);
+    plv8.elog(NOTICE, plan.free());
+    plv8.elog(NOTICE, plan.free());
+    try {
+        plan.execute([1]);
+    } catch (e) {
+        plv8.elog(NOTICE, e.message);
+    }
+$$ LANGUAGE plv8;
+
+-- the types of a plan are kept across batches
+DO $$
+    var plan = plv8.prepare('SELECT $1::int * 2 AS n', ['int']);
+    plv8.elog(NOTICE, JSON.stringify(plan.execute_batch([[1], [2]])));
+    plv8.elog(NOTICE, JSON.stringify(plan.execute_batch({ n: [3, 4] })));
+    plv8.elog(NOTICE, plan.execute([5])[0].n);
+    plan.free();
+$$ LANGUAGE plv8;
+
+DROP FUNCTION plan_insert(int, text);
+DROP TABLE plan_test;
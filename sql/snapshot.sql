@@ -0,0 +1,26 @@
+-- a startup snapshot keeps what plv8.start_proc left behind
+CREATE FUNCTION snapshot_start() RETURNS void AS $$
+  snapshot_value = 21;
+  snapshot_double = function(x) { return x * 2; };
+$$ LANGUAGE plv8;
+SET plv8.start_proc = 'snapshot_start';
+SELECT plv8_create_snapshot() > 0 AS created;
+
+\c
+-- plv8.start_proc is not run for contexts created from the snapshot
+SET plv8.start_proc = 'no_such_function';
+SET plv8.use_snapshot = on;
+DO $$ plv8.elog(NOTICE, snapshot_value, snapshot_double(snapshot_value)); $$ LANGUAGE plv8;
+DO $$ plv8.elog(NOTICE, plv8.quote_ident('Snapshot'), plv8.execute('SELECT 1 AS n')[0].n); $$ LANGUAGE plv8;
+
+\c
+DROP FUNCTION snapshot_start();
+
+-- prepared plans cannot be saved in a snapshot
+CREATE FUNCTION snapshot_start_plan() RETURNS void AS $$
+  snapshot_plan = plv8.prepare('SELECT 1 AS n');
+$$ LANGUAGE plv8;
+SET plv8.start_proc = 'snapshot_start_plan';
+SELECT plv8_create_snapshot();
+RESET plv8.start_proc;
+DROP FUNCTION snapshot_start_plan();
@@ -0,0 +1,38 @@
+CREATE TABLE stmt_test (id int PRIMARY KEY, x int);
+INSERT INTO stmt_test SELECT i, 0 FROM generate_series(1, 10) i;
+
+-- the statement is prepared once and reused
+DO $$
+    for (var i = 1; i <= 10; i++)
+        plv8.execute('UPDATE stmt_test SET x = $1 WHERE id = $2', [i * 10, i]);
+$$ LANGUAGE plv8;
+SELECT sum(x) FROM stmt_test;
+SELECT (plv8_info()->0->'statement_cache'->>'hits')::int AS hits,
+       (plv8_info()->0->'statement_cache'->>'misses')::int AS misses;
+
+-- saved plans follow changes to the table
+ALTER TABLE stmt_test ADD COLUMN y int DEFAULT 1;
+DO $$
+    var rows = plv8.execute('UPDATE stmt_test SET x = $1 WHERE id = $2 RETURNING *', [1, 1]);
+    plv8.elog(NOTICE, JSON.stringify(rows));
+$$ LANGUAGE plv8;
+
+-- errors leave the statement usable
+DO $$
+    try {
+        plv8.execute('UPDATE stmt_test SET x = 1 / $1 WHERE id = $2', [0, 1]);
+    } catch (e) {
+        plv8.elog(NOTICE, e.message);
+    }
+    plv8.execute('UPDATE stmt_test SET x = 1 / $1 WHERE id = $2', [1, 1]);
+$$ LANGUAGE plv8;
+SELECT x FROM stmt_test WHERE id = 1;
+
+SET plv8.statement_cache_size = 0;
+DO $$
+    plv8.execute('UPDATE stmt_test SET x = $1 WHERE id = $2', [0, 1]);
+$$ LANGUAGE plv8;
+SELECT (plv8_info()->0->'statement_cache'->>'hits')::int AS hits;
+RESET plv8.statement_cache_size;
+
+DROP TABLE stmt_test;
@@ -0,0 +1,53 @@
+CREATE TABLE trans_items (id int, price int);
+CREATE TABLE trans_log (id int, price int);
+
+CREATE FUNCTION trans_stmt() RETURNS trigger AS $$
+  plv8.elog(NOTICE, TG_LEVEL, TG_OP, NEW && NEW.name, OLD && OLD.name);
+  if (NEW) {
+    var n = 0;
+    for (var row of NEW)
+      n++;
+    plv8.elog(NOTICE, 'new rows', n, JSON.stringify(NEW.rows()));
+    plv8.execute('INSERT INTO trans_log SELECT id, price FROM ' +
+                 plv8.quote_ident(NEW.name) + ' WHERE price > 10');
+  }
+  if (OLD)
+    plv8.elog(NOTICE, 'old prices', JSON.stringify(Array.from(OLD.columns().price)));
+$$ LANGUAGE plv8;
+
+CREATE TRIGGER trans_ins AFTER INSERT ON trans_items
+  REFERENCING NEW TABLE AS new_items
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_stmt();
+CREATE TRIGGER trans_upd AFTER UPDATE ON trans_items
+  REFERENCING NEW TABLE AS new_items OLD TABLE AS old_items
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_stmt();
+
+INSERT INTO trans_items VALUES (1, 5), (2, 15), (3, 25);
+UPDATE trans_items SET price = price + 1 WHERE id > 1;
+SELECT * FROM trans_log ORDER BY id, price;
+
+-- a single call for many rows
+CREATE FUNCTION trans_sum() RETURNS trigger AS $$
+  var sum = 0;
+  for (var row of NEW)
+    sum += row.price;
+  plv8.elog(NOTICE, 'sum', sum);
+$$ LANGUAGE plv8;
+CREATE TRIGGER trans_sum AFTER INSERT ON trans_log
+  REFERENCING NEW TABLE AS new_log
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_sum();
+INSERT INTO trans_log SELECT i, i FROM generate_series(1, 2500) i;
+
+-- statement triggers without transition tables get no rows
+CREATE FUNCTION trans_none() RETURNS trigger AS $$
+  plv8.elog(NOTICE, typeof NEW, typeof OLD);
+$$ LANGUAGE plv8;
+CREATE TRIGGER trans_none AFTER DELETE ON trans_items
+  FOR EACH STATEMENT EXECUTE PROCEDURE trans_none();
+DELETE FROM trans_items;
+
+DROP TABLE trans_items;
+DROP TABLE trans_log;
+DROP FUNCTION trans_stmt();
+DROP FUNCTION trans_sum();
+DROP FUNCTION trans_none();